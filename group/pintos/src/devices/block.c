@@ -1,13 +1,38 @@
 #include "devices/block.h"
 #include <list.h>
+#include <round.h>
+#include <hash.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "devices/ide.h"
+#include "devices/timer.h"
+#include "threads/interrupt.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
 
 uint8_t cache_initialized = 0;
 uint8_t freeze_cache = 0;
+
+/* Most sectors moved by one call to block_read_direct() or
+   block_write_direct() on behalf of a contiguous buffer, and by
+   one command made of merged requests. */
+#define TRANSFER_BATCH 32
+
+/* A command handed to a driver's submit operation, carrying one
+   or more merged requests. */
+struct block_command
+  {
+    struct block_request req;           /* As seen by the driver. */
+    struct list batch;                  /* Requests carried, by sector. */
+    void *buffers[TRANSFER_BATCH];      /* Their buffers, if merged. */
+    uint64_t start;                     /* timer_cycles() at submission. */
+    bool in_use;                        /* Outstanding? */
+  };
+
 /* A block device. */
 struct block
   {
@@ -22,6 +47,24 @@ struct block
 
     unsigned long long read_cnt;        /* Number of sectors read. */
     unsigned long long write_cnt;       /* Number of sectors written. */
+    unsigned long long read_cmds;       /* Driver requests that read. */
+    unsigned long long write_cmds;      /* Driver requests that wrote. */
+    uint64_t read_latency[BLOCK_STATS_LATENCY_BUCKETS];
+    uint64_t write_latency[BLOCK_STATS_LATENCY_BUCKETS];
+
+    /* I/O scheduler, protected by disabling interrupts. */
+    struct list queues[BLOCK_IO_CLASS_CNT];  /* Pending requests. */
+    size_t queue_depth;                 /* Requests in QUEUES. */
+    bool busy;                          /* Is a thread dispatching? */
+    struct block_command commands[BLOCK_QUEUE_DEPTH];
+    size_t in_flight;                   /* Commands in use. */
+    block_sector_t head;                /* Sector after the last command. */
+    unsigned long long requests;        /* Requests submitted. */
+    unsigned long long demand_requests; /* Of those, demand class. */
+    unsigned long long merges;          /* Requests merged into others. */
+    unsigned long long expired;         /* Dispatched past deadline. */
+    unsigned long long queue_depth_sum; /* Depth seen by new requests. */
+    size_t max_queue_depth;             /* Largest QUEUE_DEPTH. */
   };
 
 /* List of all block devices. */
@@ -31,6 +74,32 @@ static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 static struct block *block_by_role[BLOCK_ROLE_CNT];
 
 static struct block *list_elem_to_block (struct list_elem *);
+static void count_transfer (struct block *, bool write, size_t cnt,
+                            uint64_t start);
+static void reset_counters (struct block *);
+static void dispatch_requests (struct block *, struct block_request *own);
+static void issue_commands (struct block *);
+static void command_done (struct block_request *, void *block);
+static size_t next_batch (struct block *, struct list *batch,
+                          void **buffers, void ***run_buffers);
+static void finish_batch (struct list *batch);
+static struct block_request *pick_request (struct block *);
+static void merge_requests (struct block *, struct list *batch);
+static void driver_transfer (struct block *, block_sector_t, size_t cnt,
+                             void **buffers, bool write);
+static void cache_read (struct block* block, block_sector_t sector,
+                        uint8_t* buffer, bool meta);
+static void cache_write (struct block* block, block_sector_t sector,
+                         const uint8_t* buffer, bool meta);
+static void read_contiguous (struct block *, block_sector_t, size_t cnt,
+                             uint8_t *);
+static void write_contiguous (struct block *, block_sector_t, size_t cnt,
+                              const uint8_t *);
+
+/* How long a request may wait in its device's queue, in timer
+   ticks, before it is served ahead of everything else. */
+#define DEMAND_DEADLINE (TIMER_FREQ / 20)
+#define BULK_DEADLINE (TIMER_FREQ / 2)
 
 /* Returns a human-readable name for the given block device
    TYPE. */
@@ -117,7 +186,9 @@ check_sector (struct block *block, block_sector_t sector)
 }
 
 /* Reads sector SECTOR from BLOCK into BUFFER, which must
-   have room for BLOCK_SECTOR_SIZE bytes.
+   have room for BLOCK_SECTOR_SIZE bytes.  File data is read with
+   dcache_read() instead, so the cache treats what comes through
+   here as metadata.
    Internally synchronizes accesses to block devices, so external
    per-block device locking is unneeded. */
 void
@@ -125,19 +196,18 @@ block_read (struct block *block, block_sector_t sector, void *buffer)
 {
   if (cache_initialized)
     {
-      dcache_read (block, sector, buffer);
+      cache_read (block, sector, buffer, true);
     }
   else
     {
-      check_sector (block, sector);
-      block->ops->read (block->aux, sector, buffer);
-      block->read_cnt++;
+      block_read_direct (block, sector, 1, &buffer);
     }
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
    BLOCK_SECTOR_SIZE bytes.  Returns after the block device has
-   acknowledged receiving the data.
+   acknowledged receiving the data.  Like block_read(), treated
+   as metadata by the cache.
    Internally synchronizes accesses to block devices, so external
    per-block device locking is unneeded. */
 void
@@ -145,14 +215,570 @@ block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
   if (cache_initialized)
     {
-      dcache_write (block, sector, buffer);
+      cache_write (block, sector, buffer, true);
+    }
+  else
+    {
+      block_write_direct (block, sector, 1, &buffer);
+    }
+}
+
+/* Reads CNT sectors starting at SECTOR from BLOCK into BUFFER,
+   which must have room for CNT * BLOCK_SECTOR_SIZE bytes.  Runs
+   of sectors that are not cached are read with one device
+   command where the driver supports it. */
+void
+block_read_multiple (struct block *block, block_sector_t sector,
+                     size_t cnt, void *buffer)
+{
+  if (cache_initialized)
+    dcache_read_multiple (block, sector, cnt, buffer);
+  else
+    read_contiguous (block, sector, cnt, buffer);
+}
+
+/* Writes CNT sectors starting at SECTOR to BLOCK from BUFFER,
+   which must contain CNT * BLOCK_SECTOR_SIZE bytes.  Runs of
+   sectors that are not cached are written with one device
+   command where the driver supports it. */
+void
+block_write_multiple (struct block *block, block_sector_t sector,
+                      size_t cnt, const void *buffer)
+{
+  if (cache_initialized)
+    dcache_write_multiple (block, sector, cnt, buffer);
+  else
+    write_contiguous (block, sector, cnt, buffer);
+}
+
+/* Reads CNT sectors starting at SECTOR from BLOCK into BUFFERS,
+   bypassing the buffer cache, as a demand request. */
+void
+block_read_direct (struct block *block, block_sector_t sector, size_t cnt,
+                   void **buffers)
+{
+  block_transfer (block, sector, cnt, buffers, false, BLOCK_IO_DEMAND);
+}
+
+/* Writes CNT sectors starting at SECTOR to BLOCK from BUFFERS,
+   bypassing the buffer cache, as a demand request. */
+void
+block_write_direct (struct block *block, block_sector_t sector, size_t cnt,
+                    const void **buffers)
+{
+  block_transfer (block, sector, cnt, (void **) buffers, true,
+                  BLOCK_IO_DEMAND);
+}
+
+/* Moves CNT sectors starting at SECTOR between BLOCK and BUFFERS,
+   writing if WRITE is true, through BLOCK's queue in scheduling
+   class CLASS.  Returns when the transfer is complete. */
+void
+block_transfer (struct block *block, block_sector_t sector, size_t cnt,
+                void **buffers, bool write, enum block_io_class class)
+{
+  struct block_request r;
+
+  if (cnt == 0)
+    return;
+  block_request_init (&r, block, sector, cnt, buffers, write, class);
+  block_submit (&r);
+  block_wait (&r);
+}
+
+/* Initializes R to move CNT sectors starting at SECTOR between
+   BLOCK and BUFFERS, writing if WRITE is true, in scheduling
+   class CLASS. */
+void
+block_request_init (struct block_request *r, struct block *block,
+                    block_sector_t sector, size_t cnt, void **buffers,
+                    bool write, enum block_io_class class)
+{
+  ASSERT (cnt > 0);
+  ASSERT (class < BLOCK_IO_CLASS_CNT);
+
+  r->block = block;
+  r->sector = sector;
+  r->cnt = cnt;
+  r->buffers = buffers;
+  r->write = write;
+  r->class = class;
+  r->deadline = 0;
+  r->callback = NULL;
+  r->aux = NULL;
+  r->completed = false;
+  r->waiting = false;
+  sema_init (&r->done, 0);
+}
+
+/* Adds R to its device's queue.  If the driver has a submit
+   operation, R is started as soon as the scheduler picks it, and
+   R's callback, if any, runs when the driver completes it,
+   possibly in an interrupt handler.  Otherwise R is not started
+   until some thread waits in block_wait(), so a request without a
+   callback must eventually be waited for, and one with a callback
+   is carried out before this returns. */
+void
+block_submit (struct block_request *r)
+{
+  struct block *block = r->block;
+  enum intr_level old_level;
+
+  check_sector (block, r->sector);
+  check_sector (block, r->sector + r->cnt - 1);
+  ASSERT (!r->write || block->type != BLOCK_FOREIGN);
+
+  old_level = intr_disable ();
+  r->deadline = timer_ticks () + (r->class == BLOCK_IO_DEMAND
+                                  ? DEMAND_DEADLINE : BULK_DEADLINE);
+  list_push_back (&block->queues[r->class], &r->elem);
+  block->queue_depth_sum += block->queue_depth;
+  block->queue_depth++;
+  if (block->queue_depth > block->max_queue_depth)
+    block->max_queue_depth = block->queue_depth;
+  block->requests++;
+  if (r->class == BLOCK_IO_DEMAND)
+    block->demand_requests++;
+  if (block->ops->submit != NULL)
+    issue_commands (block);
+  intr_set_level (old_level);
+
+  if (block->ops->submit == NULL && r->callback != NULL)
+    block_wait (r);
+}
+
+/* Waits for R to complete.  If R's driver has no submit
+   operation and no thread is dispatching R's device, the caller
+   becomes the dispatcher and issues queued requests, its own and
+   others', until R is done. */
+void
+block_wait (struct block_request *r)
+{
+  struct block *block = r->block;
+  enum intr_level old_level = intr_disable ();
+
+  while (!r->completed)
+    if (block->ops->submit == NULL && !block->busy)
+      dispatch_requests (block, r);
+    else
+      {
+        r->waiting = true;
+        sema_down (&r->done);
+        r->waiting = false;
+      }
+  intr_set_level (old_level);
+}
+
+/* Moves R, if it is a bulk request still waiting in its queue,
+   to the demand class, for when a thread turns out to need it.
+   Does nothing if R has already been picked or completed. */
+void
+block_promote (struct block_request *r)
+{
+  struct block *block = r->block;
+  enum intr_level old_level = intr_disable ();
+  struct list_elem *e;
+
+  if (r->class == BLOCK_IO_BULK)
+    for (e = list_begin (&block->queues[BLOCK_IO_BULK]);
+         e != list_end (&block->queues[BLOCK_IO_BULK]); e = list_next (e))
+      if (e == &r->elem)
+        {
+          int64_t deadline = timer_ticks () + DEMAND_DEADLINE;
+
+          list_remove (&r->elem);
+          r->class = BLOCK_IO_DEMAND;
+          if (deadline < r->deadline)
+            r->deadline = deadline;
+          list_push_back (&block->queues[BLOCK_IO_DEMAND], &r->elem);
+          block->demand_requests++;
+          break;
+        }
+  intr_set_level (old_level);
+}
+
+/* Marks R complete, runs its callback and wakes its waiter.
+   Drivers call this, from an interrupt handler or otherwise, when
+   they finish a request passed to their submit operation.
+   Interrupts must be off. */
+void
+block_complete (struct block_request *r)
+{
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (!r->completed);
+
+  r->completed = true;
+  if (r->callback != NULL)
+    r->callback (r, r->aux);
+  if (r->waiting)
+    sema_up (&r->done);
+}
+
+/* Issues BLOCK's queued requests in scheduling order until OWN
+   has completed, then hands the device to a thread waiting for
+   another request, if any.
+   Interrupts must be off. */
+static void
+dispatch_requests (struct block *block, struct block_request *own)
+{
+  enum block_io_class class;
+  struct list_elem *e;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+  ASSERT (!block->busy);
+
+  block->busy = true;
+  while (!own->completed)
+    {
+      void *buffers[TRANSFER_BATCH];
+      void **run_buffers;
+      struct list batch;
+      struct block_request *first;
+      size_t cnt;
+
+      cnt = next_batch (block, &batch, buffers, &run_buffers);
+      first = list_entry (list_front (&batch), struct block_request, elem);
+
+      intr_enable ();
+      driver_transfer (block, first->sector, cnt, run_buffers, first->write);
+      intr_disable ();
+
+      finish_batch (&batch);
+    }
+  block->busy = false;
+
+  /* Wake a thread waiting for a queued request to take over.  If
+     nobody is waiting yet, the next block_wait() does. */
+  for (class = 0; class < BLOCK_IO_CLASS_CNT; class++)
+    for (e = list_begin (&block->queues[class]);
+         e != list_end (&block->queues[class]); e = list_next (e))
+      {
+        struct block_request *r = list_entry (e, struct block_request, elem);
+        if (r->waiting)
+          {
+            sema_up (&r->done);
+            return;
+          }
+      }
+}
+
+/* Hands BLOCK's driver commands made of queued requests, in
+   scheduling order, while it has fewer than BLOCK_QUEUE_DEPTH.
+   Interrupts must be off. */
+static void
+issue_commands (struct block *block)
+{
+  ASSERT (intr_get_level () == INTR_OFF);
+
+  while (block->in_flight < BLOCK_QUEUE_DEPTH && block->queue_depth > 0)
+    {
+      struct block_command *cmd = block->commands;
+      struct block_request *first;
+      void **run_buffers;
+      size_t cnt;
+
+      while (cmd->in_use)
+        cmd++;
+      cmd->in_use = true;
+      block->in_flight++;
+
+      cnt = next_batch (block, &cmd->batch, cmd->buffers, &run_buffers);
+      first = list_entry (list_front (&cmd->batch),
+                          struct block_request, elem);
+      block_request_init (&cmd->req, block, first->sector, cnt, run_buffers,
+                          first->write, first->class);
+      cmd->req.callback = command_done;
+      cmd->req.aux = block;
+      cmd->start = timer_cycles ();
+      block->ops->submit (block->aux, &cmd->req);
+    }
+}
+
+/* Completes the requests carried by command REQ of BLOCK_, once
+   its driver is done with it, and issues more. */
+static void
+command_done (struct block_request *req, void *block_)
+{
+  struct block *block = block_;
+  struct block_command *cmd = (struct block_command *)
+    ((uint8_t *) req - offsetof (struct block_command, req));
+
+  count_transfer (block, req->write, req->cnt, cmd->start);
+  finish_batch (&cmd->batch);
+  cmd->in_use = false;
+  block->in_flight--;
+  issue_commands (block);
+}
+
+/* Removes the request BLOCK should serve next from its queue,
+   along with any it can be merged with, and puts them in BATCH in
+   sector order.  Returns the number of sectors and sets
+   *RUN_BUFFERS to their buffers: those of the one request, or
+   BUFFERS, which must have room for TRANSFER_BATCH, filled in.
+   Interrupts must be off and the queue nonempty. */
+static size_t
+next_batch (struct block *block, struct list *batch, void **buffers,
+            void ***run_buffers)
+{
+  struct block_request *first, *last;
+  struct list_elem *e;
+  size_t cnt = 0;
+
+  list_init (batch);
+  list_push_back (batch, &pick_request (block)->elem);
+  merge_requests (block, batch);
+  first = list_entry (list_front (batch), struct block_request, elem);
+  last = list_entry (list_back (batch), struct block_request, elem);
+  block->head = last->sector + last->cnt;
+
+  if (first == last)
+    {
+      *run_buffers = first->buffers;
+      return first->cnt;
+    }
+  for (e = list_begin (batch); e != list_end (batch); e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      memcpy (buffers + cnt, r->buffers, r->cnt * sizeof *buffers);
+      cnt += r->cnt;
+    }
+  *run_buffers = buffers;
+  return cnt;
+}
+
+/* Completes every request in BATCH.
+   Interrupts must be off. */
+static void
+finish_batch (struct list *batch)
+{
+  while (!list_empty (batch))
+    block_complete (list_entry (list_pop_front (batch),
+                                struct block_request, elem));
+}
+
+/* Removes and returns the request BLOCK should serve next.  The
+   oldest request of a class is served first if its deadline has
+   passed, demand before bulk.  Otherwise demand requests go
+   before bulk ones, in C-LOOK order: the lowest sector at or
+   after the end of the last command, else the lowest sector.
+   Interrupts must be off and the queue nonempty. */
+static struct block_request *
+pick_request (struct block *block)
+{
+  int64_t now = timer_ticks ();
+  struct block_request *best = NULL, *lowest = NULL;
+  struct list *queue = NULL;
+  enum block_io_class class;
+  struct list_elem *e;
+
+  ASSERT (block->queue_depth > 0);
+  for (class = 0; class < BLOCK_IO_CLASS_CNT; class++)
+    if (!list_empty (&block->queues[class]))
+      {
+        struct block_request *oldest
+          = list_entry (list_front (&block->queues[class]),
+                        struct block_request, elem);
+        if (now >= oldest->deadline)
+          {
+            block->expired++;
+            best = oldest;
+            break;
+          }
+        if (queue == NULL)
+          queue = &block->queues[class];
+      }
+
+  if (best == NULL)
+    for (e = list_begin (queue); e != list_end (queue); e = list_next (e))
+      {
+        struct block_request *r = list_entry (e, struct block_request, elem);
+        if (r->sector >= block->head
+            && (best == NULL || r->sector < best->sector))
+          best = r;
+        if (lowest == NULL || r->sector < lowest->sector)
+          lowest = r;
+      }
+  if (best == NULL)
+    best = lowest;
+
+  list_remove (&best->elem);
+  block->queue_depth--;
+  return best;
+}
+
+/* Moves every queued request of BLOCK that continues the run of
+   sectors in BATCH, in the same direction, into BATCH, as long as
+   the run stays within TRANSFER_BATCH sectors.  BATCH stays in
+   sector order.
+   Interrupts must be off. */
+static void
+merge_requests (struct block *block, struct list *batch)
+{
+  struct block_request *first, *last;
+  size_t cnt;
+  bool merged;
+
+  first = list_entry (list_front (batch), struct block_request, elem);
+  if (first->cnt >= TRANSFER_BATCH)
+    return;
+  last = first;
+  cnt = first->cnt;
+
+  do
+    {
+      enum block_io_class class;
+      struct list_elem *e;
+
+      merged = false;
+      for (class = 0; class < BLOCK_IO_CLASS_CNT; class++)
+        for (e = list_begin (&block->queues[class]);
+             e != list_end (&block->queues[class]); e = list_next (e))
+          {
+            struct block_request *r
+              = list_entry (e, struct block_request, elem);
+            if (r->write != first->write || cnt + r->cnt > TRANSFER_BATCH)
+              continue;
+            if (r->sector == last->sector + last->cnt)
+              {
+                list_remove (&r->elem);
+                list_push_back (batch, &r->elem);
+                last = r;
+              }
+            else if (r->sector + r->cnt == first->sector)
+              {
+                list_remove (&r->elem);
+                list_push_front (batch, &r->elem);
+                first = r;
+              }
+            else
+              continue;
+            cnt += r->cnt;
+            block->queue_depth--;
+            block->merges++;
+            merged = true;
+            break;
+          }
+    }
+  while (merged);
+}
+
+/* Moves CNT sectors starting at SECTOR between BLOCK's driver and
+   BUFFERS.  All transfers that reach a driver go through here
+   and are counted in BLOCK's statistics. */
+static void
+driver_transfer (struct block *block, block_sector_t sector, size_t cnt,
+                 void **buffers, bool write)
+{
+  uint64_t start;
+  size_t i;
+
+  if (write && block->ops->write_multiple != NULL && cnt > 1)
+    {
+      start = timer_cycles ();
+      block->ops->write_multiple (block->aux, sector, cnt,
+                                  (const void **) buffers);
+      count_transfer (block, true, cnt, start);
+    }
+  else if (!write && block->ops->read_multiple != NULL && cnt > 1)
+    {
+      start = timer_cycles ();
+      block->ops->read_multiple (block->aux, sector, cnt, buffers);
+      count_transfer (block, false, cnt, start);
+    }
+  else
+    for (i = 0; i < cnt; i++)
+      {
+        start = timer_cycles ();
+        if (write)
+          block->ops->write (block->aux, sector + i, buffers[i]);
+        else
+          block->ops->read (block->aux, sector + i, buffers[i]);
+        count_transfer (block, write, 1, start);
+      }
+}
+
+/* Records a driver request that moved CNT sectors to or from
+   BLOCK, started at START according to timer_cycles(). */
+static void
+count_transfer (struct block *block, bool write, size_t cnt, uint64_t start)
+{
+  uint64_t cycles = timer_cycles () - start;
+  enum intr_level old_level;
+  int bucket = 0;
+
+  while (bucket < BLOCK_STATS_LATENCY_BUCKETS - 1
+         && cycles >> (BLOCK_STATS_LATENCY_SHIFT + bucket + 1) != 0)
+    bucket++;
+
+  old_level = intr_disable ();
+  if (write)
+    {
+      block->write_cnt += cnt;
+      block->write_cmds++;
+      block->write_latency[bucket]++;
     }
   else
     {
-      check_sector (block, sector);
-      ASSERT (block->type != BLOCK_FOREIGN);
-      block->ops->write (block->aux, sector, buffer);
-      block->write_cnt++;
+      block->read_cnt += cnt;
+      block->read_cmds++;
+      block->read_latency[bucket]++;
+    }
+  intr_set_level (old_level);
+}
+
+/* Zeroes BLOCK's statistics. */
+static void
+reset_counters (struct block *block)
+{
+  enum intr_level old_level = intr_disable ();
+  block->read_cnt = block->write_cnt = 0;
+  block->read_cmds = block->write_cmds = 0;
+  memset (block->read_latency, 0, sizeof block->read_latency);
+  memset (block->write_latency, 0, sizeof block->write_latency);
+  block->requests = block->demand_requests = 0;
+  block->merges = block->expired = 0;
+  block->queue_depth_sum = 0;
+  block->max_queue_depth = block->queue_depth;
+  intr_set_level (old_level);
+}
+
+/* Reads CNT sectors starting at SECTOR from BLOCK into the
+   contiguous BUFFER, bypassing the buffer cache. */
+static void
+read_contiguous (struct block *block, block_sector_t sector, size_t cnt,
+                 uint8_t *buffer)
+{
+  void *buffers[TRANSFER_BATCH];
+  while (cnt > 0)
+    {
+      size_t batch = cnt < TRANSFER_BATCH ? cnt : TRANSFER_BATCH;
+      size_t i;
+      for (i = 0; i < batch; i++)
+        buffers[i] = buffer + i * BLOCK_SECTOR_SIZE;
+      block_read_direct (block, sector, batch, buffers);
+      sector += batch;
+      buffer += batch * BLOCK_SECTOR_SIZE;
+      cnt -= batch;
+    }
+}
+
+/* Writes CNT sectors starting at SECTOR to BLOCK from the
+   contiguous BUFFER, bypassing the buffer cache. */
+static void
+write_contiguous (struct block *block, block_sector_t sector, size_t cnt,
+                  const uint8_t *buffer)
+{
+  const void *buffers[TRANSFER_BATCH];
+  while (cnt > 0)
+    {
+      size_t batch = cnt < TRANSFER_BATCH ? cnt : TRANSFER_BATCH;
+      size_t i;
+      for (i = 0; i < batch; i++)
+        buffers[i] = buffer + i * BLOCK_SECTOR_SIZE;
+      block_write_direct (block, sector, batch, buffers);
+      sector += batch;
+      buffer += batch * BLOCK_SECTOR_SIZE;
+      cnt -= batch;
     }
 }
 
@@ -177,6 +803,20 @@ block_type (struct block *block)
   return block->type;
 }
 
+/* Returns the number of sectors read from BLOCK's driver. */
+unsigned long long
+block_read_cnt (struct block *block)
+{
+  return block->read_cnt;
+}
+
+/* Returns the number of sectors written to BLOCK's driver. */
+unsigned long long
+block_write_cnt (struct block *block)
+{
+  return block->write_cnt;
+}
+
 /* Prints statistics for each block device used for a Pintos role. */
 void
 block_print_stats (void)
@@ -206,6 +846,8 @@ block_register (const char *name, enum block_type type,
                 const struct block_operations *ops, void *aux)
 {
   struct block *block = malloc (sizeof *block);
+  size_t i;
+
   if (block == NULL)
     PANIC ("Failed to allocate memory for block device descriptor");
 
@@ -215,8 +857,15 @@ block_register (const char *name, enum block_type type,
   block->size = size;
   block->ops = ops;
   block->aux = aux;
-  block->read_cnt = 0;
-  block->write_cnt = 0;
+  list_init (&block->queues[BLOCK_IO_DEMAND]);
+  list_init (&block->queues[BLOCK_IO_BULK]);
+  block->queue_depth = 0;
+  block->busy = false;
+  block->head = 0;
+  block->in_flight = 0;
+  for (i = 0; i < BLOCK_QUEUE_DEPTH; i++)
+    block->commands[i].in_use = false;
+  reset_counters (block);
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
@@ -241,80 +890,339 @@ list_elem_to_block (struct list_elem *list_elem)
 /* Filesys cache. */
 
 struct cache_block;
-struct cache_block * search_cache (struct block* block, block_sector_t sector);
+struct cache_shard;
+struct run_write;
+struct write_back_slot;
+struct cache_shard * get_shard (struct block* block, block_sector_t sector);
+static void lock_shard (struct cache_shard* shard);
+struct cache_block * lookup_cache (struct cache_shard* shard,
+                                   struct block* block, block_sector_t sector);
+struct cache_block * search_cache (struct block* block, block_sector_t sector,
+                                   bool meta);
+void release_block (struct cache_block* cache_block);
 int flag_helper (uint8_t value, uint8_t mask);
 int is_dirty (struct cache_block* cache_block);
 int is_valid (struct cache_block* cache_block);
 void mark_dirty (struct cache_block* cache_block);
 void mark_valid (struct cache_block* cache_block);
-int cache_hit (struct block* block, block_sector_t sector,
-            struct cache_block* cache_block);
 void flush_block (struct cache_block* cache_block);
-struct cache_block *make_eviction (struct block* block, block_sector_t sector);
-struct cache_block *dcache_alloc (struct block *block, block_sector_t sector);
+void load_block (struct cache_block* cache_block, enum block_io_class class);
+struct cache_block *make_eviction (struct block* block, block_sector_t sector,
+                                   bool meta, struct block_request *read);
+struct cache_block *dcache_alloc (struct block *block, block_sector_t sector,
+                                  bool meta);
+struct cache_block *dcache_overwrite (struct block *block,
+                                      block_sector_t sector, bool meta);
+static struct cache_block *get_block (struct block *block,
+                                      block_sector_t sector, bool meta,
+                                      bool load);
 void clear_block (struct cache_block* cache_block);
 void evict_block (struct cache_block* cache_block);
 void set_block (struct block* block, block_sector_t sector,
                   struct cache_block* cache_block);
+void cache_write_behind (void);
+static void write_run (struct cache_block** run, size_t cnt,
+                       enum block_io_class class);
+static void submit_run (struct run_write *, struct cache_block** run,
+                        size_t cnt, enum block_io_class class);
+static void finish_run (struct run_write *);
+static void write_back_cluster (struct cache_block* cache_block);
+static void write_back (bool evict);
+static void finish_slot (struct write_back_slot* slot, bool evict);
+static void adjust_dirty_cnt (int delta);
+static void cache_flusher (void *aux UNUSED);
+static void cache_flush_timer (void *aux UNUSED);
+static void prefetch_block (struct block* block, block_sector_t sector);
+static void cache_prefetcher (void *aux UNUSED);
+static unsigned cache_hash (const struct hash_elem *e, void *aux UNUSED);
+static bool cache_less (const struct hash_elem *a, const struct hash_elem *b,
+                        void *aux UNUSED);
+static unsigned key_hash (const struct hash_elem *e, void *aux UNUSED);
+static bool key_less (const struct hash_elem *a, const struct hash_elem *b,
+                      void *aux UNUSED);
 
-const uint8_t CACHE_SIZE = 64;
 const unsigned int CHANCES = 3;
 const uint8_t DIRTY_BIT = 1;
 const uint8_t VALID_BIT = 2;
-struct cache_block** dcache;
-uint8_t clock_hand;
-struct lock global_cache_lock;
+
+/* Number of sectors in the cache.  Set by cache_configure() from
+   the -cache kernel option, before cache_init() runs. */
+size_t cache_size = CACHE_DEFAULT_SIZE;
+struct cache_block* dcache;   // Metadata, one entry per cache slot.
+uint8_t* dcache_data;         // Sector data, page-aligned and contiguous.
+size_t dcache_data_pages;
+
+/* The cache is split into shards, each owning a fixed slice of
+   dcache and caching the sectors that get_shard() maps to it, so
+   that accesses to different shards never share a lock.  There
+   is one shard per CACHE_SHARD_MIN_SIZE blocks, up to
+   CACHE_MAX_SHARDS. */
+#define CACHE_SHARD_MIN_SIZE 8
+#define CACHE_MAX_SHARDS 16
+struct cache_shard
+  {
+    struct lock lock;             // Protects the fields below, and the
+                                  // index, policy fields and ref_cnt
+                                  // of blocks.
+    struct hash index;            // (type, sector) -> cache_block.
+    struct cache_block* blocks;   // First block of this shard.
+    size_t size;                  // Number of blocks.
+    struct list free_list;        // Blocks holding no sector.
+    struct cache_stats stats;     // Writebacks are counted without the
+                                  // lock, see flush_block.
+
+    /* Replacement policy state. */
+    size_t clock_hand;            // Clock: next block to look at.
+    struct list a1in;             // 2Q: blocks used once, newest first.
+    struct list am;               // 2Q: blocks used again, MRU first.
+    size_t a1in_cnt;              // 2Q: length of a1in.
+    struct cache_key* a1out;      // 2Q: ring of sectors dropped from a1in.
+    size_t a1out_size;
+    size_t a1out_head;
+    size_t a1out_cnt;
+    struct hash a1out_index;      // 2Q: (type, sector) -> a1out entry.
+  };
+struct cache_shard* shards;
+size_t shard_cnt;
+
+/* Identifies a sector no longer in the cache. */
+struct cache_key
+  {
+    enum block_type type;
+    block_sector_t sector;
+    struct hash_elem hash_elem;   // Element in shard->a1out_index.
+  };
+
+/* A replacement policy.  It keeps track of the indexed blocks of
+   each shard and picks the victims for make_eviction().  META is
+   true for inode, pointer-block and directory sectors, which a
+   policy may keep in preference to file data.  All functions are
+   called with the shard's lock held. */
+struct cache_policy
+  {
+    const char *name;
+    void (*insert) (struct cache_shard *, struct cache_block *, bool meta);
+    void (*touch) (struct cache_shard *, struct cache_block *, bool meta);
+    void (*remove) (struct cache_shard *, struct cache_block *);
+
+    /* Returns a clean, unreferenced block to evict, or NULL.  Sets
+       *DIRTY to a dirty one it passed over, if it is still NULL. */
+    struct cache_block *(*select) (struct cache_shard *,
+                                   struct cache_block **dirty);
+  };
+
+static const struct cache_policy clock_policy;
+static const struct cache_policy twoq_policy;
+
+/* Policy used by every shard.  Set with the -cache-policy kernel
+   option. */
+static const struct cache_policy *cache_policy = &clock_policy;
+
+/* Write-behind.  The flusher writes dirty blocks back every
+   cache_flush_interval ticks, or as soon as cache_dirty_limit
+   blocks are dirty (0 means half the cache).  Set with the
+   -cache-flush and -cache-dirty kernel options. */
+int64_t cache_flush_interval = CACHE_DEFAULT_FLUSH_INTERVAL;
+size_t cache_dirty_limit = 0;
+size_t dirty_cnt;                 // Dirty blocks, see adjust_dirty_cnt().
+struct semaphore flusher_wakeup;  // Up'd to start a write-behind pass.
+static void (*cache_sync_hook) (void);  // Run before each pass, or NULL.
+
+/* Read-ahead.  dcache_prefetch() queues sectors here and the
+   prefetcher thread loads them into the cache.  Requests that
+   don't fit are dropped. */
+#define PREFETCH_QUEUE_SIZE 64
+struct prefetch_request
+  {
+    struct block* block;
+    block_sector_t sector;
+  };
+struct prefetch_request prefetch_queue[PREFETCH_QUEUE_SIZE];
+size_t prefetch_head;             // Next request to service.
+size_t prefetch_cnt;              // Requests queued.
+struct lock prefetch_lock;        // Protects the queue.
+struct semaphore prefetch_wakeup; // Up'd once per queued request.
+
+/* A cached sector.  A thread that wants a block first takes a
+   reference to it under its shard's lock and only then acquires
+   the block's lock, and it drops the reference after releasing
+   the lock (see release_block).  make_eviction only reuses blocks
+   with no references, so a referenced block keeps its sector and
+   a block's lock is never held while ref_cnt is 0. */
 struct cache_block
   {
     uint8_t flags; // Valid/Dirty
     block_sector_t sector; // location
     struct lock lock; // mutual exclusion
     uint8_t use;   // For clock_hand algorithm
-    uint8_t data[BLOCK_SECTOR_SIZE]; // block content --> should be 512 bytes
+    bool in_am;    // For 2Q: on shard->am rather than shard->a1in
+    bool prefetched; // Loaded by read-ahead and not used since
+    struct block_request* loading; // Read-ahead in progress, or NULL
+    struct list_elem lru_elem; // For 2Q: element in shard->a1in or am
+    unsigned ref_cnt; // Threads holding or waiting for lock
+    uint8_t* data; // block content, BLOCK_SECTOR_SIZE bytes in dcache_data
     enum block_type type;
     struct block_operations* ops;
     void* aux;
+    struct block* block;
+    struct cache_shard* shard;
+    struct hash_elem hash_elem; // Element in shard->index.
+    struct list_elem free_elem; // Element in shard->free_list.
   };
 
-int
-cache_hit (struct block* block, block_sector_t sector,
-            struct cache_block* cache_block)
+/* A run of dirty blocks being written back, see submit_run(). */
+struct run_write
+  {
+    struct cache_block** run;           /* Blocks, in sector order. */
+    size_t cnt;                         /* Number of blocks. */
+    void *buffers[TRANSFER_BATCH];      /* Their data. */
+    struct block_request req;           /* The write. */
+  };
+
+/* Runs that write_back() keeps in flight at once, so that it
+   keeps every device busy and devices on different channels
+   work in parallel. */
+#define WRITE_BACK_DEPTH 4
+
+/* A slot for one of write_back()'s runs. */
+struct write_back_slot
+  {
+    struct cache_block* run[TRANSFER_BATCH];
+    struct run_write write;
+    bool busy;                          /* Submitted, not finished? */
+  };
+
+static unsigned
+cache_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct cache_block *cache_block =
+    hash_entry (e, struct cache_block, hash_elem);
+  return hash_int ((int) (cache_block->sector * BLOCK_CNT + cache_block->type));
+}
+
+static bool
+cache_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  const struct cache_block *x = hash_entry (a, struct cache_block, hash_elem);
+  const struct cache_block *y = hash_entry (b, struct cache_block, hash_elem);
+  if (x->type != y->type)
+    return x->type < y->type;
+  return x->sector < y->sector;
+}
+
+static unsigned
+key_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct cache_key *key = hash_entry (e, struct cache_key, hash_elem);
+  return hash_int ((int) (key->sector * BLOCK_CNT + key->type));
+}
+
+static bool
+key_less (const struct hash_elem *a, const struct hash_elem *b,
+          void *aux UNUSED)
+{
+  const struct cache_key *x = hash_entry (a, struct cache_key, hash_elem);
+  const struct cache_key *y = hash_entry (b, struct cache_key, hash_elem);
+  if (x->type != y->type)
+    return x->type < y->type;
+  return x->sector < y->sector;
+}
+
+/* Returns the shard that caches SECTOR of BLOCK.  Consecutive
+   sectors land in different shards. */
+struct cache_shard *
+get_shard (struct block* block UNUSED, block_sector_t sector)
+{
+  return &shards[hash_int ((int) sector) % shard_cnt];
+}
+
+/* Acquires SHARD's lock, counting the wait if it is held. */
+static void
+lock_shard (struct cache_shard* shard)
 {
-  return is_valid (cache_block) &&
-          (sector == cache_block->sector) &&
-          (block->type == cache_block->type);
+  if (!lock_try_acquire (&shard->lock))
+    {
+      lock_acquire (&shard->lock);
+      shard->stats.lock_waits++;
+    }
 }
 
-/* Search the cache for `sector` and return it if found else return NULL. */
+/* Returns the block of SHARD indexed under `sector`, or NULL.
+   The block is neither referenced nor locked.
+   Assumes thread_current owns SHARD's lock. */
 struct cache_block *
-search_cache (struct block* block, block_sector_t sector)
+lookup_cache (struct cache_shard* shard, struct block* block,
+              block_sector_t sector)
 {
-  lock_acquire (&global_cache_lock);
-  int i;
-  for (i = 0; i < CACHE_SIZE; ++i)
+  struct cache_block key;
+  struct hash_elem *e;
+
+  key.sector = sector;
+  key.type = block->type;
+  e = hash_find (&shard->index, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct cache_block, hash_elem) : NULL;
+}
+
+/* Search the cache for `sector` and return it, referenced and
+   locked, if found.  Otherwise return NULL with the shard's lock
+   held, so that the caller can install `sector` without racing
+   other misses. */
+struct cache_block *
+search_cache (struct block* block, block_sector_t sector, bool meta)
+{
+  struct cache_shard *shard = get_shard (block, sector);
+  struct cache_block *cache_block;
+  bool locked;
+
+  lock_shard (shard);
+  cache_block = lookup_cache (shard, block, sector);
+  if (cache_block == NULL)
     {
-      if (cache_hit (block, sector, dcache[i]))
-        {
-          hits++;
-          if (dcache[i]->use < CHANCES)
-            dcache[i]->use++;
-          lock_release (&global_cache_lock);
-          lock_acquire (&dcache[i]->lock);
-          if (cache_hit (block, sector, dcache[i]))
-            {
-              return dcache[i];
-            }
-          else
-            {
-              lock_release (&dcache[i]->lock);
-              lock_acquire (&global_cache_lock);
-              i = -1;
-            }
-        }
+      shard->stats.misses++;
+      return NULL;
     }
 
-  misses++;
-  return NULL;
+  shard->stats.hits++;
+  if (cache_block->prefetched)
+    {
+      shard->stats.readahead_hits++;
+      cache_block->prefetched = false;
+    }
+  cache_policy->touch (shard, cache_block, meta);
+  cache_block->ref_cnt++;
+  locked = lock_try_acquire (&cache_block->lock);
+  if (!locked)
+    {
+      shard->stats.lock_waits++;
+      if (cache_block->loading != NULL)
+        block_promote (cache_block->loading);
+    }
+  lock_release (&shard->lock);
+
+  /* The reference keeps the block on `sector`.  If it is still
+     being loaded, its loader holds the lock until it is valid;
+     a read-ahead we wait for has been promoted to demand above. */
+  if (!locked)
+    lock_acquire (&cache_block->lock);
+  ASSERT (is_valid (cache_block));
+  return cache_block;
+}
+
+/* Unlocks CACHE_BLOCK and drops the caller's reference to it.  A
+   block that was cleared goes back on the free list once the last
+   reference is gone. */
+void
+release_block (struct cache_block* cache_block)
+{
+  struct cache_shard *shard = cache_block->shard;
+
+  lock_release (&cache_block->lock);
+  lock_shard (shard);
+  ASSERT (cache_block->ref_cnt > 0);
+  if (--cache_block->ref_cnt == 0 && cache_block->ops == NULL)
+    list_push_back (&shard->free_list, &cache_block->free_elem);
+  lock_release (&shard->lock);
 }
 
 int
@@ -339,30 +1247,166 @@ void
 flush_block (struct cache_block* cache_block)
 {
   if (is_valid (cache_block) && is_dirty (cache_block))
-    {
-      cache_block->ops->write (cache_block->aux, cache_block->sector, cache_block->data);
-    }
+    write_run (&cache_block, 1, BLOCK_IO_DEMAND);
 }
 
-void
-clear_block (struct cache_block* cache_block)
+/* Writes back the CNT dirty blocks in RUN, which cache
+   consecutive sectors of one device, with a single request in
+   scheduling class CLASS.
+   Assumes thread_current owns their locks. */
+static void
+write_run (struct cache_block** run, size_t cnt, enum block_io_class class)
 {
-  cache_block->flags = 0;
-  cache_block->sector = 0;
-  cache_block->type = 0;
-  cache_block->ops = NULL;
-  cache_block->aux = NULL;
+  struct run_write w;
+
+  submit_run (&w, run, cnt, class);
+  finish_run (&w);
 }
 
-void
-evict_block (struct cache_block* cache_block)
+/* Starts writing back RUN as write_run() does, using W, and
+   returns without waiting.  RUN must stay as it is, and locked,
+   until finish_run (W). */
+static void
+submit_run (struct run_write *w, struct cache_block** run, size_t cnt,
+            enum block_io_class class)
 {
-  flush_block (cache_block);
-  clear_block (cache_block);
+  size_t i;
+
+  ASSERT (cnt > 0 && cnt <= TRANSFER_BATCH);
+  w->run = run;
+  w->cnt = cnt;
+  for (i = 0; i < cnt; i++)
+    w->buffers[i] = run[i]->data;
+  block_request_init (&w->req, run[0]->block, run[0]->sector, cnt,
+                      w->buffers, true, class);
+  block_submit (&w->req);
 }
 
-void
-mark_valid (struct cache_block* cache_block)
+/* Waits for the write started by submit_run (W) and marks its
+   blocks clean. */
+static void
+finish_run (struct run_write *w)
+{
+  size_t i;
+
+  block_wait (&w->req);
+  for (i = 0; i < w->cnt; i++)
+    {
+      struct cache_block* cache_block = w->run[i];
+      enum intr_level old_level;
+
+      cache_block->flags &= ~DIRTY_BIT;
+      adjust_dirty_cnt (-1);
+
+      /* Only the block's lock is held here. */
+      old_level = intr_disable ();
+      cache_block->shard->stats.writebacks++;
+      intr_set_level (old_level);
+    }
+}
+
+/* References and locks the block caching SECTOR of BLOCK if it is
+   dirty and nobody else references it.  Returns it, or NULL. */
+static struct cache_block *
+claim_dirty (struct block* block, block_sector_t sector)
+{
+  struct cache_shard* shard = get_shard (block, sector);
+  struct cache_block* cache_block;
+
+  lock_shard (shard);
+  cache_block = lookup_cache (shard, block, sector);
+  if (cache_block != NULL && cache_block->ref_cnt == 0
+      && is_valid (cache_block) && is_dirty (cache_block))
+    {
+      /* Unreferenced, so this does not block. */
+      cache_block->ref_cnt++;
+      lock_acquire (&cache_block->lock);
+    }
+  else
+    cache_block = NULL;
+  lock_release (&shard->lock);
+  return cache_block;
+}
+
+/* Writes back dirty CACHE_BLOCK in one request together with
+   whatever dirty, unreferenced blocks cache the sectors just
+   before and after it, so that evicting one dirty block cleans
+   its neighbours too.
+   Assumes thread_current owns CACHE_BLOCK's lock and no shard
+   lock. */
+static void
+write_back_cluster (struct cache_block* cache_block)
+{
+  struct block* block = cache_block->block;
+  struct cache_block* run[TRANSFER_BATCH];
+  struct cache_block* below[TRANSFER_BATCH / 2];
+  struct cache_block* neighbor;
+  size_t below_cnt = 0, cnt = 0, i;
+  block_sector_t last;
+
+  while (below_cnt < TRANSFER_BATCH / 2
+         && cache_block->sector > below_cnt
+         && (neighbor = claim_dirty (block, cache_block->sector - below_cnt - 1))
+            != NULL)
+    below[below_cnt++] = neighbor;
+  while (below_cnt > 0)
+    run[cnt++] = below[--below_cnt];
+  run[cnt++] = cache_block;
+
+  last = cache_block->sector;
+  while (cnt < TRANSFER_BATCH && last + 1 < block_size (block)
+         && (neighbor = claim_dirty (block, last + 1)) != NULL)
+    {
+      run[cnt++] = neighbor;
+      last++;
+    }
+
+  write_run (run, cnt, BLOCK_IO_DEMAND);
+  for (i = 0; i < cnt; i++)
+    if (run[i] != cache_block)
+      release_block (run[i]);
+}
+
+/* Drops CACHE_BLOCK from its shard's index.  The caller decides
+   whether it goes on the free list.
+   Assumes thread_current owns the shard's lock. */
+void
+clear_block (struct cache_block* cache_block)
+{
+  if (cache_block->ops != NULL)
+    {
+      hash_delete (&cache_block->shard->index, &cache_block->hash_elem);
+      cache_policy->remove (cache_block->shard, cache_block);
+    }
+  if (is_dirty (cache_block))
+    adjust_dirty_cnt (-1);
+  cache_block->flags = 0;
+  cache_block->sector = 0;
+  cache_block->type = 0;
+  cache_block->ops = NULL;
+  cache_block->aux = NULL;
+  cache_block->block = NULL;
+  cache_block->prefetched = false;
+}
+
+/* Writes CACHE_BLOCK back and, unless another thread also holds a
+   reference to it, drops it from the cache.
+   Assumes thread_current owns CACHE_BLOCK's lock but not its
+   shard's lock. */
+void
+evict_block (struct cache_block* cache_block)
+{
+  struct cache_shard *shard = cache_block->shard;
+
+  flush_block (cache_block);
+  lock_shard (shard);
+  if (cache_block->ref_cnt == 1)
+    clear_block (cache_block);
+  lock_release (&shard->lock);
+}
+
+void
+mark_valid (struct cache_block* cache_block)
 {
   cache_block->flags |= VALID_BIT;
 }
@@ -370,9 +1414,29 @@ mark_valid (struct cache_block* cache_block)
 void
 mark_dirty (struct cache_block* cache_block)
 {
-  cache_block->flags |= DIRTY_BIT;
+  if (!is_dirty (cache_block))
+    {
+      cache_block->flags |= DIRTY_BIT;
+      adjust_dirty_cnt (1);
+    }
 }
 
+/* Adds DELTA to dirty_cnt, waking the flusher when the count
+   reaches the high-water mark.  Callers only hold the lock of the
+   block that changed, so the update is done with interrupts off. */
+static void
+adjust_dirty_cnt (int delta)
+{
+  enum intr_level old_level = intr_disable ();
+  dirty_cnt += delta;
+  if (delta > 0 && dirty_cnt == cache_dirty_limit)
+    sema_up (&flusher_wakeup);
+  intr_set_level (old_level);
+}
+
+/* Points CACHE_BLOCK at SECTOR of BLOCK and indexes it.  The
+   data is not valid until load_block.
+   Assumes thread_current owns the shard's lock. */
 void
 set_block (struct block* block, block_sector_t sector,
                   struct cache_block* cache_block)
@@ -380,51 +1444,364 @@ set_block (struct block* block, block_sector_t sector,
   cache_block->sector = sector;
   cache_block->ops = (struct block_operations*) block->ops;
   cache_block->aux = block->aux;
+  cache_block->block = block;
   cache_block->type = block->type;
-  cache_block->ops->read (cache_block->aux, cache_block->sector,
-                          cache_block->data);
+  hash_insert (&cache_block->shard->index, &cache_block->hash_elem);
+}
+
+/* Reads CACHE_BLOCK's sector in scheduling class CLASS.
+   Assumes thread_current owns CACHE_BLOCK's lock. */
+void
+load_block (struct cache_block* cache_block, enum block_io_class class)
+{
+  void *data = cache_block->data;
+  block_transfer (cache_block->block, cache_block->sector, 1, &data, false,
+                  class);
   mark_valid (cache_block);
 }
 
+/* Installs SECTOR in a block of its shard, taken from the free
+   list or else picked by cache_policy.  Clean blocks are
+   preferred, so that a miss does not wait on write-back that the
+   flusher can do instead.  Returns the block referenced and
+   locked, for the caller to fill with load_block(), or NULL if
+   the caller has to search again: either the
+   only victim was dirty and had to be written back first, or
+   every block of the shard is in use.
+   If READ is not NULL, it is a request to read SECTOR, with room
+   for one buffer, that is pointed at the block's data, submitted
+   and published in the block's LOADING before the shard's lock is
+   released, so that it is queued by the time anyone can find the
+   block.
+   Assumes thread_current owns the shard's lock, and always
+   releases it. */
 struct cache_block*
-make_eviction (struct block* block, block_sector_t sector)
+make_eviction (struct block* block, block_sector_t sector, bool meta,
+               struct block_request *read)
 {
-  /* Assumes thread_current owns global_cache_lock. */
-  while (dcache[clock_hand]->use > 0)
+  struct cache_shard* shard = get_shard (block, sector);
+  struct cache_block* result = NULL;
+  struct cache_block* dirty = NULL;
+
+  if (!list_empty (&shard->free_list))
+    result = list_entry (list_pop_front (&shard->free_list),
+                         struct cache_block, free_elem);
+  else
+    result = cache_policy->select (shard, &dirty);
+
+  if (result == NULL && dirty != NULL)
     {
-      dcache[clock_hand]->use--;
-      clock_hand = (clock_hand + 1) % CACHE_SIZE;
+      sema_up (&flusher_wakeup);
+      result = dirty;
     }
-  struct cache_block* result = dcache[clock_hand];
-  result->use = CHANCES;
-  clock_hand = (clock_hand + 1) % CACHE_SIZE;
 
-  lock_release (&global_cache_lock);
+  if (result == NULL)
+    {
+      /* Everything is in use; let the holders make progress. */
+      lock_release (&shard->lock);
+      thread_yield ();
+      return NULL;
+    }
+
+  /* Nobody references RESULT, so nobody holds its lock and this
+     does not block. */
+  result->ref_cnt++;
   lock_acquire (&result->lock);
 
-  evict_block (result);
+  if (is_valid (result) && is_dirty (result))
+    {
+      /* Write back outside the shard's lock.  The block stays
+         indexed under its old sector until it is clean. */
+      lock_release (&shard->lock);
+      write_back_cluster (result);
+      release_block (result);
+      return NULL;
+    }
+
+  if (result->ops != NULL)
+    shard->stats.evictions++;
+  clear_block (result);
   set_block (block, sector, result);
+  cache_policy->insert (shard, result, meta);
+  if (read != NULL)
+    {
+      /* Without a callback, block_submit() does not block. */
+      read->buffers[0] = result->data;
+      block_submit (read);
+      result->loading = read;
+    }
+  lock_release (&shard->lock);
   return result;
 }
 
 /* Returns the cache entry associated with a particular
-   block, evicting an entry if necessary. */
+   block, evicting an entry if necessary.  The entry is
+   referenced and locked; give it back with release_block(). */
+struct cache_block *
+dcache_alloc (struct block *block, block_sector_t sector, bool meta)
+{
+  return get_block (block, sector, meta, true);
+}
+
+/* Like dcache_alloc(), for a caller that is about to overwrite
+   all of SECTOR: a miss is not read from disk.  The caller must
+   fill the whole block before releasing it. */
 struct cache_block *
-dcache_alloc (struct block *block, block_sector_t sector)
+dcache_overwrite (struct block *block, block_sector_t sector, bool meta)
+{
+  return get_block (block, sector, meta, false);
+}
+
+/* Does the work of dcache_alloc() and dcache_overwrite().  A
+   miss is read from disk only if LOAD is true. */
+static struct cache_block *
+get_block (struct block *block, block_sector_t sector, bool meta, bool load)
+{
+  struct cache_block * result;
+  do
+    {
+      result = search_cache (block, sector, meta);
+      if (result == NULL)
+        {
+          result = make_eviction (block, sector, meta, NULL);
+          if (result != NULL && load)
+            load_block (result, BLOCK_IO_DEMAND);
+          else if (result != NULL)
+            mark_valid (result);   // The caller fills it in.
+        }
+    }
+  while (result == NULL);
+  return result;
+}
+
+/* The clock policy.  Each hit gives a block another chance, up to
+   CHANCES, and the hand takes one away from every block it passes
+   until it finds one with none left. */
+static void
+clock_insert (struct cache_shard* shard UNUSED,
+              struct cache_block* cache_block, bool meta UNUSED)
+{
+  cache_block->use = CHANCES;
+}
+
+static void
+clock_touch (struct cache_shard* shard UNUSED,
+             struct cache_block* cache_block, bool meta UNUSED)
+{
+  if (cache_block->use < CHANCES)
+    cache_block->use++;
+}
+
+static void
+clock_remove (struct cache_shard* shard UNUSED,
+              struct cache_block* cache_block UNUSED)
+{
+}
+
+static struct cache_block *
+clock_select (struct cache_shard* shard, struct cache_block** dirty)
+{
+  size_t steps;
+
+  for (steps = 0; steps < (CHANCES + 2) * shard->size; steps++)
+    {
+      struct cache_block* cache_block = &shard->blocks[shard->clock_hand];
+      shard->clock_hand = (shard->clock_hand + 1) % shard->size;
+      if (cache_block->ref_cnt > 0 || cache_block->ops == NULL)
+        continue;
+      if (cache_block->use > 0)
+        cache_block->use--;
+      else if (is_dirty (cache_block))
+        *dirty = (*dirty == NULL) ? cache_block : *dirty;
+      else
+        return cache_block;
+    }
+  return NULL;
+}
+
+static const struct cache_policy clock_policy =
+  {
+    "clock",
+    clock_insert,
+    clock_touch,
+    clock_remove,
+    clock_select,
+  };
+
+/* The 2Q policy (Johnson and Shasha, VLDB '94).  A sector enters
+   on a1in, which is FIFO, and only moves to the LRU list am if it
+   is used again after falling out of a1in while it is remembered
+   on a1out.  Victims come from a1in while it holds more than a
+   quarter of the shard, so a long sequential scan only cycles
+   through a1in and leaves am alone.  Metadata goes straight to
+   am.  a1out_index finds a sector on a1out without a scan. */
+static bool
+twoq_forgotten (struct cache_shard* shard, struct cache_block* cache_block)
+{
+  struct cache_key key;
+
+  key.type = cache_block->type;
+  key.sector = cache_block->sector;
+  return hash_find (&shard->a1out_index, &key.hash_elem) != NULL;
+}
+
+static void
+twoq_insert (struct cache_shard* shard, struct cache_block* cache_block,
+             bool meta)
+{
+  cache_block->in_am = meta || twoq_forgotten (shard, cache_block);
+  if (cache_block->in_am)
+    list_push_front (&shard->am, &cache_block->lru_elem);
+  else
+    {
+      list_push_front (&shard->a1in, &cache_block->lru_elem);
+      shard->a1in_cnt++;
+    }
+}
+
+static void
+twoq_touch (struct cache_shard* shard, struct cache_block* cache_block,
+            bool meta)
+{
+  if (!cache_block->in_am && !meta)
+    return;
+
+  list_remove (&cache_block->lru_elem);
+  if (!cache_block->in_am)
+    {
+      shard->a1in_cnt--;
+      cache_block->in_am = true;
+    }
+  list_push_front (&shard->am, &cache_block->lru_elem);
+}
+
+static void
+twoq_remove (struct cache_shard* shard, struct cache_block* cache_block)
+{
+  list_remove (&cache_block->lru_elem);
+  if (!cache_block->in_am)
+    {
+      struct cache_key *key;
+
+      shard->a1in_cnt--;
+      if (shard->a1out_cnt == shard->a1out_size)
+        {
+          /* Forget the oldest entry, unless a newer one for the
+             same sector has taken its place in the index. */
+          key = &shard->a1out[shard->a1out_head];
+          if (hash_find (&shard->a1out_index, &key->hash_elem)
+              == &key->hash_elem)
+            hash_delete (&shard->a1out_index, &key->hash_elem);
+          shard->a1out_head = (shard->a1out_head + 1) % shard->a1out_size;
+          shard->a1out_cnt--;
+        }
+      key = &shard->a1out[(shard->a1out_head + shard->a1out_cnt)
+                          % shard->a1out_size];
+      key->type = cache_block->type;
+      key->sector = cache_block->sector;
+      hash_replace (&shard->a1out_index, &key->hash_elem);
+      shard->a1out_cnt++;
+    }
+  cache_block->in_am = false;
+}
+
+/* Returns the oldest clean, unreferenced block on LIST. */
+static struct cache_block *
+twoq_scan (struct list* list, struct cache_block** dirty)
 {
-  struct cache_block * result = search_cache (block, sector);
-  result = (result == NULL) ? make_eviction (block, sector) : result;
+  struct list_elem *e;
+
+  for (e = list_rbegin (list); e != list_rend (list); e = list_prev (e))
+    {
+      struct cache_block* cache_block =
+        list_entry (e, struct cache_block, lru_elem);
+      if (cache_block->ref_cnt > 0)
+        continue;
+      if (!is_dirty (cache_block))
+        return cache_block;
+      if (*dirty == NULL)
+        *dirty = cache_block;
+    }
+  return NULL;
+}
+
+static struct cache_block *
+twoq_select (struct cache_shard* shard, struct cache_block** dirty)
+{
+  struct cache_block* result = NULL;
+
+  if (shard->a1in_cnt > shard->size / 4)
+    result = twoq_scan (&shard->a1in, dirty);
+  if (result == NULL)
+    result = twoq_scan (&shard->am, dirty);
+  if (result == NULL)
+    result = twoq_scan (&shard->a1in, dirty);
   return result;
 }
 
+static const struct cache_policy twoq_policy =
+  {
+    "2q",
+    twoq_insert,
+    twoq_touch,
+    twoq_remove,
+    twoq_select,
+  };
+
+/* Pins SECTOR of BLOCK in the cache and returns its contents,
+   which stay in place and unchanged until the caller passes *PIN
+   to dcache_unpin().  Holding a pin keeps the sector locked, so
+   the caller must not use the cache in any other way, or pin a
+   second sector, before unpinning. */
+const void *
+dcache_pin (struct block* block, block_sector_t sector,
+            struct cache_block** pin)
+{
+  ASSERT (cache_initialized);
+  check_sector (block, sector);
+  *pin = dcache_alloc (block, sector, true);
+  return (*pin)->data;
+}
+
+/* Like dcache_pin(), but the caller may modify the contents.  It
+   must then pass true as DIRTY to dcache_unpin(). */
+void *
+dcache_pin_writable (struct block* block, block_sector_t sector,
+                     struct cache_block** pin)
+{
+  ASSERT (block->type != BLOCK_FOREIGN);
+  return (void *) dcache_pin (block, sector, pin);
+}
+
+/* Releases a sector pinned by dcache_pin() or
+   dcache_pin_writable(), marking it dirty if DIRTY.  Does nothing
+   if PIN is a null pointer. */
+void
+dcache_unpin (struct cache_block* pin, bool dirty)
+{
+  if (pin == NULL)
+    return;
+  if (dirty)
+    mark_dirty (pin);
+  release_block (pin);
+}
+
 void
 dcache_read (struct block* block, block_sector_t sector, uint8_t* buffer)
+{
+  cache_read (block, sector, buffer, false);
+}
+
+/* Reads SECTOR through the cache.  META is passed on to
+   cache_policy. */
+static void
+cache_read (struct block* block, block_sector_t sector, uint8_t* buffer,
+            bool meta)
 {
   check_sector (block, sector);
-  struct cache_block* cache_block = dcache_alloc (block, sector);
+  struct cache_block* cache_block = dcache_alloc (block, sector, meta);
   memcpy ((void*) buffer, (const void*) cache_block->data, BLOCK_SECTOR_SIZE);
-  lock_release (&cache_block->lock);
-  block->read_cnt++;
+  release_block (cache_block);
 }
 
 void
@@ -437,14 +1814,22 @@ dcache_read_at_offset (struct block* block, block_sector_t sector,
   if (size <= 0 || sector_ofs < 0)
     return;
 
-  struct cache_block* cache_block = dcache_alloc (block, sector);
+  struct cache_block* cache_block = dcache_alloc (block, sector, false);
   memcpy (buffer, (cache_block->data) + sector_ofs, size);
-  lock_release (&cache_block->lock);
-  block->read_cnt++;
+  release_block (cache_block);
 }
 
 void
 dcache_write (struct block* block, block_sector_t sector, const uint8_t* buffer)
+{
+  cache_write (block, sector, buffer, false);
+}
+
+/* Writes SECTOR through the cache.  META is passed on to
+   cache_policy. */
+static void
+cache_write (struct block* block, block_sector_t sector,
+             const uint8_t* buffer, bool meta)
 {
   check_sector (block, sector);
   ASSERT (block->type != BLOCK_FOREIGN);
@@ -452,28 +1837,27 @@ dcache_write (struct block* block, block_sector_t sector, const uint8_t* buffer)
   if (freeze_cache)
     {
       // PASS:
-      cache_block = search_cache (block, sector);
+      cache_block = search_cache (block, sector, meta);
       if (cache_block == NULL)
        {
-         lock_release (&global_cache_lock);
-         block->ops->write (block->aux, sector, buffer);
-         block->write_cnt++;
+         const void *data = buffer;
+         lock_release (&get_shard (block, sector)->lock);
+         block_write_direct (block, sector, 1, &data);
        }
       else
        {
          memcpy (cache_block->data, buffer, BLOCK_SECTOR_SIZE);
          mark_dirty (cache_block);
          evict_block (cache_block);
-         lock_release (&cache_block->lock);
+         release_block (cache_block);
        }
     }
   else
     {
-      cache_block = dcache_alloc (block, sector);
+      cache_block = dcache_overwrite (block, sector, meta);
       memcpy (cache_block->data, buffer, BLOCK_SECTOR_SIZE);
       mark_dirty (cache_block);
-      lock_release (&cache_block->lock);
-      block->write_cnt++;
+      release_block (cache_block);
     }
 }
 
@@ -489,13 +1873,175 @@ dcache_write_at_offset (struct block* block, block_sector_t sector,
   if (size <= 0 || sector_ofs < 0)
     return;
 
-  struct cache_block* cache_block = dcache_alloc (block, sector);
+  struct cache_block* cache_block;
+  if (wipe || (sector_ofs == 0 && size == BLOCK_SECTOR_SIZE))
+    cache_block = dcache_overwrite (block, sector, false);
+  else
+    cache_block = dcache_alloc (block, sector, false);
   if (wipe)
     memset (cache_block->data, 0, BLOCK_SECTOR_SIZE);
   memcpy (cache_block->data + sector_ofs, buffer, size);
   mark_dirty (cache_block);
-  lock_release (&cache_block->lock);
-  block->write_cnt++;
+  release_block (cache_block);
+}
+
+/* Reads CNT sectors starting at SECTOR into BUFFER.  Cached
+   sectors are copied out of the cache; each run of uncached
+   sectors is read straight from BLOCK in one transfer, without
+   being installed in the cache. */
+void
+dcache_read_multiple (struct block* block, block_sector_t sector,
+                      size_t cnt, uint8_t* buffer)
+{
+  size_t run = 0;     // Uncached sectors ending just before I.
+  size_t i;
+
+  for (i = 0; i <= cnt; i++)
+    {
+      struct cache_block* cache_block = NULL;
+      if (i < cnt)
+        {
+          check_sector (block, sector + i);
+          cache_block = search_cache (block, sector + i, false);
+          if (cache_block == NULL)
+            {
+              lock_release (&get_shard (block, sector + i)->lock);
+              run++;
+              continue;
+            }
+        }
+
+      read_contiguous (block, sector + i - run, run,
+                       buffer + (i - run) * BLOCK_SECTOR_SIZE);
+      run = 0;
+      if (cache_block != NULL)
+        {
+          memcpy (buffer + i * BLOCK_SECTOR_SIZE, cache_block->data,
+                  BLOCK_SECTOR_SIZE);
+          release_block (cache_block);
+        }
+    }
+}
+
+/* Writes CNT sectors starting at SECTOR from BUFFER.  Cached
+   sectors are updated in the cache; each run of uncached sectors
+   is written straight to BLOCK in one transfer.  A run that
+   another thread brought into the cache while it was being
+   written is updated in the cache afterward as well. */
+void
+dcache_write_multiple (struct block* block, block_sector_t sector,
+                       size_t cnt, const uint8_t* buffer)
+{
+  size_t run = 0;     // Uncached sectors ending just before I.
+  size_t i, j;
+
+  ASSERT (block->type != BLOCK_FOREIGN);
+  for (i = 0; i <= cnt; i++)
+    {
+      struct cache_block* cache_block = NULL;
+      if (i < cnt)
+        {
+          check_sector (block, sector + i);
+          cache_block = search_cache (block, sector + i, false);
+          if (cache_block == NULL)
+            {
+              lock_release (&get_shard (block, sector + i)->lock);
+              run++;
+              continue;
+            }
+        }
+
+      write_contiguous (block, sector + i - run, run,
+                        buffer + (i - run) * BLOCK_SECTOR_SIZE);
+      for (j = i - run; j < i; j++)
+        {
+          struct cache_shard* shard = get_shard (block, sector + j);
+          struct cache_block* copy;
+          lock_shard (shard);
+          copy = lookup_cache (shard, block, sector + j);
+          if (copy != NULL)
+            copy->ref_cnt++;
+          lock_release (&shard->lock);
+          if (copy == NULL)
+            continue;
+          lock_acquire (&copy->lock);
+          memcpy (copy->data, buffer + j * BLOCK_SECTOR_SIZE,
+                  BLOCK_SECTOR_SIZE);
+          release_block (copy);
+        }
+      run = 0;
+      if (cache_block != NULL)
+        {
+          memcpy (cache_block->data, buffer + i * BLOCK_SECTOR_SIZE,
+                  BLOCK_SECTOR_SIZE);
+          mark_dirty (cache_block);
+          release_block (cache_block);
+        }
+    }
+}
+
+/* Sets the number of sectors the cache holds.  Must be called
+   before cache_init(). */
+void
+cache_configure (size_t sectors)
+{
+  ASSERT (!cache_initialized);
+  if (sectors < CACHE_MIN_SIZE)
+    sectors = CACHE_MIN_SIZE;
+  if (sectors > CACHE_MAX_SIZE)
+    sectors = CACHE_MAX_SIZE;
+  cache_size = sectors;
+}
+
+/* Selects the replacement policy named NAME, "clock" or "2q".
+   Returns false if there is no such policy.  Must be called
+   before cache_init(). */
+bool
+cache_set_policy (const char *name)
+{
+  static const struct cache_policy *policies[] =
+    {
+      &clock_policy,
+      &twoq_policy,
+    };
+  size_t i;
+
+  ASSERT (!cache_initialized);
+  for (i = 0; i < sizeof policies / sizeof *policies; i++)
+    if (name != NULL && !strcmp (name, policies[i]->name))
+      {
+        cache_policy = policies[i];
+        return true;
+      }
+  return false;
+}
+
+/* Sets how often, in timer ticks, the flusher writes dirty blocks
+   back.  Must be called before cache_init(). */
+void
+cache_set_flush_interval (int64_t ticks)
+{
+  ASSERT (!cache_initialized);
+  cache_flush_interval = ticks > 0 ? ticks : CACHE_DEFAULT_FLUSH_INTERVAL;
+}
+
+/* Sets the number of dirty blocks that wakes the flusher before
+   its interval is up.  Must be called before cache_init(). */
+void
+cache_set_dirty_limit (size_t sectors)
+{
+  ASSERT (!cache_initialized);
+  cache_dirty_limit = sectors;
+}
+
+/* Sets HOOK to be called by the flusher before each write-behind
+   pass, so that a file system can write the metadata it keeps in
+   memory to the cache in time to go out with the pass.  NULL
+   removes the hook. */
+void
+cache_set_sync_hook (void (*hook) (void))
+{
+  cache_sync_hook = hook;
 }
 
 void
@@ -504,21 +2050,343 @@ cache_init (void)
   if (cache_initialized)
     return;
 
-  dcache = (struct cache_block**) malloc (CACHE_SIZE * sizeof (struct cache_block*));
-  int i;
-  for (i = 0; i < CACHE_SIZE; ++i)
+  /* Sector data lives in whole pages, apart from the metadata, so
+     every buffer is sector-aligned.  Shrink the cache if the
+     kernel pool can't hold the requested size. */
+  for (;;)
     {
-      dcache[i] = (struct cache_block*) malloc (sizeof (struct cache_block));
-      clear_block (dcache[i]);
-      dcache[i]->use = 0;
-      lock_init (&dcache[i]->lock);
+      dcache_data_pages = DIV_ROUND_UP (cache_size * BLOCK_SECTOR_SIZE, PGSIZE);
+      dcache_data = palloc_get_multiple (0, dcache_data_pages);
+      if (dcache_data != NULL)
+        break;
+      if (cache_size / 2 < CACHE_MIN_SIZE)
+        PANIC ("Failed to allocate buffer cache");
+      cache_size /= 2;
+      printf ("cache: kernel pool too small, using %zu sectors\n", cache_size);
+    }
+
+  dcache = (struct cache_block*) malloc (cache_size * sizeof (struct cache_block));
+  if (dcache == NULL)
+    PANIC ("Failed to allocate buffer cache");
+
+  shard_cnt = cache_size / CACHE_SHARD_MIN_SIZE;
+  if (shard_cnt > CACHE_MAX_SHARDS)
+    shard_cnt = CACHE_MAX_SHARDS;
+  shards = (struct cache_shard*) malloc (shard_cnt * sizeof (struct cache_shard));
+  if (shards == NULL)
+    PANIC ("Failed to allocate buffer cache");
+
+  /* Deal the blocks out to the shards, the first
+     cache_size % shard_cnt shards getting one extra. */
+  size_t i, j;
+  struct cache_block* next = dcache;
+  for (i = 0; i < shard_cnt; ++i)
+    {
+      struct cache_shard* shard = &shards[i];
+      lock_init (&shard->lock);
+      if (!hash_init (&shard->index, cache_hash, cache_less, NULL))
+        PANIC ("Failed to allocate buffer cache index");
+      shard->blocks = next;
+      shard->size = cache_size / shard_cnt + (i < cache_size % shard_cnt);
+      list_init (&shard->free_list);
+      memset (&shard->stats, 0, sizeof shard->stats);
+      shard->clock_hand = 0;
+      list_init (&shard->a1in);
+      list_init (&shard->am);
+      shard->a1in_cnt = 0;
+      shard->a1out_size = shard->size / 2;
+      shard->a1out_head = shard->a1out_cnt = 0;
+      shard->a1out = NULL;
+      if (cache_policy == &twoq_policy)
+        {
+          shard->a1out = malloc (shard->a1out_size * sizeof *shard->a1out);
+          if (shard->a1out == NULL
+              || !hash_init (&shard->a1out_index, key_hash, key_less, NULL))
+            PANIC ("Failed to allocate buffer cache");
+        }
+      for (j = 0; j < shard->size; ++j)
+        {
+          struct cache_block* cache_block = &shard->blocks[j];
+          cache_block->data = dcache_data
+                              + (cache_block - dcache) * BLOCK_SECTOR_SIZE;
+          cache_block->shard = shard;
+          cache_block->ops = NULL;
+          cache_block->flags = 0;
+          clear_block (cache_block);
+          cache_block->use = 0;
+          cache_block->in_am = false;
+          cache_block->prefetched = false;
+          cache_block->loading = NULL;
+          cache_block->ref_cnt = 0;
+          lock_init (&cache_block->lock);
+          list_push_back (&shard->free_list, &cache_block->free_elem);
+        }
+      next += shard->size;
     }
-  clock_hand = 0;
-  lock_init (&global_cache_lock);
+
+  dirty_cnt = 0;
+  if (cache_dirty_limit == 0 || cache_dirty_limit > cache_size)
+    cache_dirty_limit = cache_size / 2;
+  sema_init (&flusher_wakeup, 0);
+
+  prefetch_head = prefetch_cnt = 0;
+  lock_init (&prefetch_lock);
+  sema_init (&prefetch_wakeup, 0);
   cache_initialized = 1;
 
-  misses = 0;
-  hits = 0;
+  thread_create ("cache_flusher", PRI_DEFAULT, cache_flusher, NULL);
+  thread_create ("cache_timer", PRI_DEFAULT, cache_flush_timer, NULL);
+  thread_create ("cache_prefetch", PRI_DEFAULT, cache_prefetcher, NULL);
+}
+
+/* Asks the prefetcher to bring SECTOR of BLOCK into the cache
+   and returns without waiting for it. */
+void
+dcache_prefetch (struct block* block, block_sector_t sector)
+{
+  if (!cache_initialized || sector >= block->size)
+    return;
+
+  lock_acquire (&prefetch_lock);
+  if (prefetch_cnt < PREFETCH_QUEUE_SIZE)
+    {
+      struct prefetch_request *r =
+        &prefetch_queue[(prefetch_head + prefetch_cnt) % PREFETCH_QUEUE_SIZE];
+      r->block = block;
+      r->sector = sector;
+      prefetch_cnt++;
+      sema_up (&prefetch_wakeup);
+    }
+  lock_release (&prefetch_lock);
+}
+
+/* Loads SECTOR of BLOCK into the cache unless it is already
+   there.  Unlike dcache_alloc(), does not count as a hit or miss.
+   The read is a bulk request, published in the block's LOADING,
+   so that a demand reader that finds the block locked can promote
+   it instead of waiting behind other bulk requests. */
+static void
+prefetch_block (struct block* block, block_sector_t sector)
+{
+  struct cache_block* cache_block = NULL;
+  struct block_request r;
+  void *data = NULL;
+
+  block_request_init (&r, block, sector, 1, &data, false, BLOCK_IO_BULK);
+  while (cache_block == NULL)
+    {
+      struct cache_shard* shard = get_shard (block, sector);
+      lock_shard (shard);
+      if (lookup_cache (shard, block, sector) != NULL)
+        {
+          lock_release (&shard->lock);
+          return;
+        }
+      cache_block = make_eviction (block, sector, false, &r);
+    }
+  block_wait (&r);
+  mark_valid (cache_block);
+
+  /* Still locked, so no demand read can have used it yet. */
+  lock_shard (cache_block->shard);
+  cache_block->loading = NULL;
+  cache_block->prefetched = true;
+  cache_block->shard->stats.readaheads++;
+  lock_release (&cache_block->shard->lock);
+  release_block (cache_block);
+}
+
+/* Read-ahead thread. */
+static void
+cache_prefetcher (void *aux UNUSED)
+{
+  for (;;)
+    {
+      struct prefetch_request r;
+
+      sema_down (&prefetch_wakeup);
+      lock_acquire (&prefetch_lock);
+      r = prefetch_queue[prefetch_head];
+      prefetch_head = (prefetch_head + 1) % PREFETCH_QUEUE_SIZE;
+      prefetch_cnt--;
+      lock_release (&prefetch_lock);
+
+      prefetch_block (r.block, r.sector);
+    }
+}
+
+/* References CACHE_BLOCK, whatever sector it holds, so that it
+   keeps it.  Returns false, without doing so, if it holds none. */
+static bool
+ref_block (struct cache_block* cache_block)
+{
+  struct cache_shard* shard = cache_block->shard;
+  bool indexed;
+
+  lock_shard (shard);
+  indexed = cache_block->ops != NULL;
+  if (indexed)
+    cache_block->ref_cnt++;
+  lock_release (&shard->lock);
+  return indexed;
+}
+
+/* Orders cache blocks by device, then by sector. */
+static int
+compare_blocks (const void *a_, const void *b_)
+{
+  const struct cache_block *a = *(struct cache_block * const *) a_;
+  const struct cache_block *b = *(struct cache_block * const *) b_;
+
+  if (a->block != b->block)
+    return a->block < b->block ? -1 : 1;
+  if (a->sector != b->sector)
+    return a->sector < b->sector ? -1 : 1;
+  return 0;
+}
+
+/* Unlocks and releases CACHE_BLOCK after write_back() is done
+   with it, dropping it from the cache if EVICT. */
+static void
+finish_block (struct cache_block* cache_block, bool evict)
+{
+  if (evict)
+    evict_block (cache_block);
+  release_block (cache_block);
+}
+
+/* Writes back every dirty block in order of sector, merging
+   blocks that cache consecutive sectors into one request.  If
+   EVICT, also drops every block nobody else is using.  Up to
+   WRITE_BACK_DEPTH requests are in flight at once.
+
+   All the blocks are referenced first, which pins their sectors,
+   and then sorted.  They are locked in that order, so this never
+   waits on a lock while other threads wait on the locks it holds:
+   everyone else holds at most one block lock, or claims more only
+   if they are unreferenced. */
+static void
+write_back (bool evict)
+{
+  struct cache_block** blocks;
+  struct write_back_slot* slots;
+  struct write_back_slot* slot;
+  size_t cnt = 0, run_cnt = 0, cur = 0, i;
+
+  blocks = malloc (cache_size * sizeof *blocks);
+  slots = malloc (WRITE_BACK_DEPTH * sizeof *slots);
+  if (blocks == NULL || slots == NULL)
+    {
+      /* Fall back to writing blocks one at a time. */
+      free (blocks);
+      free (slots);
+      for (i = 0; i < cache_size; ++i)
+        if ((evict || is_dirty (&dcache[i])) && ref_block (&dcache[i]))
+          {
+            lock_acquire (&dcache[i].lock);
+            flush_block (&dcache[i]);
+            finish_block (&dcache[i], evict);
+          }
+      return;
+    }
+  for (i = 0; i < WRITE_BACK_DEPTH; i++)
+    slots[i].busy = false;
+
+  for (i = 0; i < cache_size; ++i)
+    if ((evict || is_dirty (&dcache[i])) && ref_block (&dcache[i]))
+      blocks[cnt++] = &dcache[i];
+  qsort (blocks, cnt, sizeof *blocks, compare_blocks);
+
+  slot = &slots[0];
+  for (i = 0; i < cnt; i++)
+    {
+      struct cache_block* cache_block = blocks[i];
+
+      lock_acquire (&cache_block->lock);
+      if (run_cnt > 0
+          && (run_cnt == TRANSFER_BATCH
+              || cache_block->block != slot->run[0]->block
+              || cache_block->sector != slot->run[run_cnt - 1]->sector + 1
+              || !is_valid (cache_block) || !is_dirty (cache_block)))
+        {
+          /* Start this run, and make room for the next by
+             finishing the oldest one still in flight. */
+          submit_run (&slot->write, slot->run, run_cnt, BLOCK_IO_BULK);
+          slot->busy = true;
+          run_cnt = 0;
+          cur = (cur + 1) % WRITE_BACK_DEPTH;
+          slot = &slots[cur];
+          if (slot->busy)
+            finish_slot (slot, evict);
+        }
+
+      if (is_valid (cache_block) && is_dirty (cache_block))
+        slot->run[run_cnt++] = cache_block;
+      else
+        finish_block (cache_block, evict);
+    }
+  if (run_cnt > 0)
+    {
+      submit_run (&slot->write, slot->run, run_cnt, BLOCK_IO_BULK);
+      slot->busy = true;
+    }
+  for (i = 1; i <= WRITE_BACK_DEPTH; i++)
+    {
+      slot = &slots[(cur + i) % WRITE_BACK_DEPTH];
+      if (slot->busy)
+        finish_slot (slot, evict);
+    }
+  free (slots);
+  free (blocks);
+}
+
+/* Finishes the run in SLOT of write_back(), unlocking and
+   releasing its blocks, and dropping them from the cache if
+   EVICT. */
+static void
+finish_slot (struct write_back_slot* slot, bool evict)
+{
+  size_t i;
+
+  finish_run (&slot->write);
+  for (i = 0; i < slot->write.cnt; i++)
+    finish_block (slot->run[i], evict);
+  slot->busy = false;
+}
+
+/* Writes every dirty block back to disk, in order of sector.
+   Lookups and evictions of other blocks carry on meanwhile. */
+void
+cache_write_behind (void)
+{
+  write_back (false);
+}
+
+/* Write-behind thread. */
+static void
+cache_flusher (void *aux UNUSED)
+{
+  for (;;)
+    {
+      void (*hook) (void);
+
+      sema_down (&flusher_wakeup);
+      hook = cache_sync_hook;
+      if (hook != NULL)
+        hook ();
+      cache_write_behind ();
+    }
+}
+
+/* Wakes the flusher every cache_flush_interval ticks. */
+static void
+cache_flush_timer (void *aux UNUSED)
+{
+  for (;;)
+    {
+      timer_sleep (cache_flush_interval);
+      sema_up (&flusher_wakeup);
+    }
 }
 
 void
@@ -527,33 +2395,105 @@ flush_cache (void)
   if (!cache_initialized)
     return;
   freeze_cache = 1;
-  int i;
-  for (i = 0; i < CACHE_SIZE; ++i)
-    {
-      lock_acquire (&dcache[i]->lock);
-      evict_block (dcache[i]);
-      lock_release (&dcache[i]->lock);
-    }
+  write_back (true);
   freeze_cache = 0;
 }
 
+/* Empties the cache and zeroes the cache and device statistics. */
 void
 reset_buffer_cache(void)
 {
-  if (!cache_initialized)
-    return;
+  struct list_elem *e;
 
   flush_cache ();
-  lock_acquire (&global_cache_lock);
+  for (e = list_begin (&all_blocks); e != list_end (&all_blocks);
+       e = list_next (e))
+    reset_counters (list_entry (e, struct block, list_elem));
 
-  int i;
-  for (i = 0; i < CACHE_SIZE; ++i) {
-    //lock_acquire (&dcache[i]->lock);
-    //evict_block (dcache[i]);
-    dcache[i]->use = 0;
-    //lock_release (&dcache[i]->lock);
-  }
-
-  hits = misses = 0;
-  lock_release (&global_cache_lock);
+  size_t i, j;
+  for (i = 0; i < shard_cnt; ++i)
+    {
+      lock_shard (&shards[i]);
+      for (j = 0; j < shards[i].size; ++j)
+        shards[i].blocks[j].use = 0;
+      memset (&shards[i].stats, 0, sizeof shards[i].stats);
+      lock_release (&shards[i].lock);
+    }
+}
+
+/* Returns the number of cache hits since the last reset. */
+int
+cache_hits (void)
+{
+  size_t i;
+  int sum = 0;
+  for (i = 0; i < shard_cnt; ++i)
+    sum += shards[i].stats.hits;
+  return sum;
+}
+
+/* Returns the number of cache misses since the last reset. */
+int
+cache_misses (void)
+{
+  size_t i;
+  int sum = 0;
+  for (i = 0; i < shard_cnt; ++i)
+    sum += shards[i].stats.misses;
+  return sum;
+}
+
+/* Fills in STATS with the cache and device statistics. */
+void
+block_get_stats (struct block_stats *stats)
+{
+  struct list_elem *e;
+  size_t i;
+
+  memset (stats, 0, sizeof *stats);
+  for (i = 0; i < shard_cnt; ++i)
+    {
+      struct cache_stats *total = &stats->cache;
+      struct cache_stats *s = &shards[i].stats;
+      enum intr_level old_level;
+
+      lock_shard (&shards[i]);
+      old_level = intr_disable ();
+      total->hits += s->hits;
+      total->misses += s->misses;
+      total->evictions += s->evictions;
+      total->writebacks += s->writebacks;
+      total->readaheads += s->readaheads;
+      total->readahead_hits += s->readahead_hits;
+      total->lock_waits += s->lock_waits;
+      intr_set_level (old_level);
+      lock_release (&shards[i].lock);
+    }
+
+  for (e = list_begin (&all_blocks);
+       e != list_end (&all_blocks)
+         && stats->device_cnt < BLOCK_STATS_MAX_DEVICES;
+       e = list_next (e))
+    {
+      struct block *block = list_entry (e, struct block, list_elem);
+      struct device_stats *d = &stats->devices[stats->device_cnt++];
+      enum intr_level old_level;
+
+      strlcpy (d->name, block->name, sizeof d->name);
+      old_level = intr_disable ();
+      d->read_cnt = block->read_cnt;
+      d->write_cnt = block->write_cnt;
+      d->read_cmds = block->read_cmds;
+      d->write_cmds = block->write_cmds;
+      memcpy (d->read_latency, block->read_latency, sizeof d->read_latency);
+      memcpy (d->write_latency, block->write_latency,
+              sizeof d->write_latency);
+      d->requests = block->requests;
+      d->demand_requests = block->demand_requests;
+      d->merges = block->merges;
+      d->expired = block->expired;
+      d->queue_depth_sum = block->queue_depth_sum;
+      d->max_queue_depth = block->max_queue_depth;
+      intr_set_level (old_level);
+    }
 }
@@ -1,8 +1,12 @@
 #ifndef DEVICES_BLOCK_H
 #define DEVICES_BLOCK_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <inttypes.h>
+#include <list.h>
+#include <block-stats.h>
+#include "threads/synch.h"
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -53,26 +57,111 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multiple (struct block *, block_sector_t, size_t cnt,
+                          void *);
+void block_write_multiple (struct block *, block_sector_t, size_t cnt,
+                           const void *);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
+unsigned long long block_read_cnt (struct block *);
+unsigned long long block_write_cnt (struct block *);
 
 /* Statistics. */
 void block_print_stats (void);
-int hits;
-int misses;
+void block_get_stats (struct block_stats *);
+int cache_hits (void);
+int cache_misses (void);
 
 /* Lower-level interface to block device drivers. */
 
+struct block_request;
+
+/* Commands a device with a submit operation can have outstanding
+   at once.  With two, the driver has the next command ready to
+   start as soon as one finishes. */
+#define BLOCK_QUEUE_DEPTH 2
+
+/* READ_MULTIPLE and WRITE_MULTIPLE are optional.  They transfer
+   CNT consecutive sectors, starting at the given sector, into or
+   out of the CNT sector-sized BUFFERS, which need not be
+   contiguous.
+
+   SUBMIT is optional too.  It starts a request, or queues it
+   behind the driver's others, without waiting for it, and may be
+   called with interrupts off, even from an interrupt handler.
+   The driver owns the request's ELEM until it passes the request
+   to block_complete().  The block layer has at most
+   BLOCK_QUEUE_DEPTH requests outstanding with a driver at once. */
 struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+    void (*read_multiple) (void *aux, block_sector_t, size_t cnt,
+                           void **buffers);
+    void (*write_multiple) (void *aux, block_sector_t, size_t cnt,
+                            const void **buffers);
+    void (*submit) (void *aux, struct block_request *);
   };
 
 struct block *block_register (const char *name, enum block_type,
                               const char *extra_info, block_sector_t size,
                               const struct block_operations *, void *aux);
 
+/* Uncached transfers, for drivers layered on other devices and
+   for the buffer cache itself. */
+void block_read_direct (struct block *, block_sector_t, size_t cnt,
+                        void **buffers);
+void block_write_direct (struct block *, block_sector_t, size_t cnt,
+                         const void **buffers);
+
+/* I/O scheduler.
+
+   Every uncached transfer becomes a request in its device's
+   queue.  Bulk requests wait behind demand requests until their
+   deadline passes; within a class, requests are served in
+   elevator order, and adjacent ones are merged into a single
+   driver command. */
+enum block_io_class
+  {
+    BLOCK_IO_DEMAND,            /* A thread is waiting for it. */
+    BLOCK_IO_BULK,              /* Write-back and read-ahead. */
+    BLOCK_IO_CLASS_CNT
+  };
+
+/* A transfer of CNT consecutive sectors, as submitted to
+   block_submit().  Owned by the caller, which must leave it alone
+   until it completes: until block_wait() returns, or until its
+   callback runs.  A callback must not free a request that some
+   thread is waiting for. */
+struct block_request
+  {
+    struct block *block;        /* Device. */
+    block_sector_t sector;      /* First sector. */
+    size_t cnt;                 /* Number of sectors. */
+    void **buffers;             /* CNT sector-sized buffers. */
+    bool write;                 /* Write if true, read if false. */
+    enum block_io_class class;  /* Scheduling class. */
+    void (*callback) (struct block_request *, void *aux);
+                                /* Called on completion, or NULL. */
+    void *aux;                  /* Passed to CALLBACK. */
+
+    int64_t deadline;           /* Timer tick it should start by. */
+    bool completed;             /* Has the driver finished it? */
+    bool waiting;               /* Is its owner in block_wait()? */
+    struct semaphore done;      /* Up'd on completion if waiting. */
+    struct list_elem elem;      /* Queue or batch element. */
+  };
+
+void block_request_init (struct block_request *, struct block *,
+                         block_sector_t, size_t cnt, void **buffers,
+                         bool write, enum block_io_class);
+void block_submit (struct block_request *);
+void block_wait (struct block_request *);
+void block_promote (struct block_request *);
+void block_complete (struct block_request *);
+void block_transfer (struct block *, block_sector_t, size_t cnt,
+                     void **buffers, bool write, enum block_io_class);
+
 /******************************************************************************/
 void dcache_read (struct block* block, block_sector_t sector, uint8_t* buffer);
 void dcache_read_at_offset (struct block* block, block_sector_t sector,
@@ -81,7 +170,33 @@ void dcache_write (struct block* block, block_sector_t sector, const uint8_t* bu
 void dcache_write_at_offset (struct block* block, block_sector_t sector,
                               const uint8_t* buffer, int sector_ofs,
                               int size, int wipe);
+struct cache_block;
+const void *dcache_pin (struct block* block, block_sector_t sector,
+                        struct cache_block** pin);
+void *dcache_pin_writable (struct block* block, block_sector_t sector,
+                           struct cache_block** pin);
+void dcache_unpin (struct cache_block* pin, bool dirty);
+void dcache_read_multiple (struct block* block, block_sector_t sector,
+                           size_t cnt, uint8_t* buffer);
+void dcache_write_multiple (struct block* block, block_sector_t sector,
+                            size_t cnt, const uint8_t* buffer);
+/* Buffer cache size, in sectors.  Override the default with the
+   -cache kernel option. */
+#define CACHE_DEFAULT_SIZE 64
+#define CACHE_MIN_SIZE 16
+#define CACHE_MAX_SIZE 8192
+
+/* Write-behind interval, in timer ticks.  Override with the
+   -cache-flush kernel option. */
+#define CACHE_DEFAULT_FLUSH_INTERVAL 100
+
+void cache_configure (size_t sectors);
+bool cache_set_policy (const char *name);
+void cache_set_flush_interval (int64_t ticks);
+void cache_set_dirty_limit (size_t sectors);
+void cache_set_sync_hook (void (*hook) (void));
 void cache_init (void);
+void dcache_prefetch (struct block* block, block_sector_t sector);
 void flush_cache (void);
 void reset_buffer_cache(void);
 /******************************************************************************/
@@ -8,10 +8,20 @@
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
-   controller.  It attempts to comply to [ATA-3]. */
+   controller.  It attempts to comply to [ATA-3].  If the
+   controller is a PCI bus-master IDE controller, such as the
+   PIIX that QEMU emulates, data is moved by DMA, otherwise by
+   PIO.
+
+   Transfers are queued per device.  Each channel runs one
+   request at a time, and its interrupt handler moves the data,
+   completes the request and starts the next one, so callers
+   need not wait for their own. */
 
 /* ATA command block port addresses. */
 #define reg_data(CHANNEL) ((CHANNEL)->reg_base + 0)     /* Data. */
@@ -49,6 +59,42 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Bus master IDE port addresses, relative to a channel's
+   bm_base.  See the PCI IDE Controller specification. */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bm_base + 0) /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)  /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)    /* PRD table. */
+
+/* Bus master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start/stop bus master. */
+#define BM_CMD_READ 0x08        /* 1=device to memory, 0=memory to device. */
+
+/* Bus master Status Register bits. */
+#define BM_STA_ERR 0x02         /* DMA error. */
+#define BM_STA_INTR 0x04        /* Device interrupted.  Write 1 to clear. */
+
+/* PCI configuration space access. */
+#define PCI_CONFIG_ADDRESS 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+#define PCI_REG_ID 0x00         /* Device ID : Vendor ID. */
+#define PCI_REG_COMMAND 0x04    /* Status : Command. */
+#define PCI_REG_CLASS 0x08      /* Class : Subclass : Prog IF : Revision. */
+#define PCI_REG_BAR4 0x20       /* Bus master IDE base address. */
+#define PCI_CMD_IO 0x0001       /* I/O space enable. */
+#define PCI_CMD_MASTER 0x0004   /* Bus master enable. */
+
+/* Status Register bits. */
+#define STA_ERR 0x01            /* Error. */
+
+/* Most sectors one command can transfer: a sector count of 0
+   means 256. */
+#define MAX_SECTORS_PER_COMMAND 256
 
 /* An ATA device. */
 struct ata_disk
@@ -57,8 +103,24 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    int multiple;               /* Sectors per interrupt in READ/WRITE
+                                   MULTIPLE, or 0 if unsupported. */
+    bool dma;                   /* Transfer by DMA? */
+    struct list queue;          /* Requests waiting for the channel. */
   };
 
+/* A physical region descriptor, one entry in the table that
+   tells the bus master where to move data.  A region must not
+   cross a 64 kB boundary. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address. */
+    uint16_t size;              /* Byte count. */
+    uint16_t flags;             /* PRD_EOT on the last entry. */
+  };
+#define PRD_EOT 0x8000
+#define PRD_CNT (PGSIZE / sizeof (struct prd))
+
 /* An ATA channel (aka controller).
    Each channel can control up to two disks. */
 struct channel
@@ -67,10 +129,24 @@ struct channel
     uint16_t reg_base;          /* Base I/O port. */
     uint8_t irq;                /* Interrupt in use. */
 
-    struct lock lock;           /* Must acquire to access the controller. */
     bool expecting_interrupt;   /* True if an interrupt is expected, false if
                                    any interrupt would be spurious. */
-    struct semaphore completion_wait;   /* Up'd by interrupt handler. */
+    struct semaphore completion_wait;   /* Up'd by interrupt handler, while
+                                           identifying disks. */
+
+    /* Request in progress, advanced by the interrupt handler.
+       Protected, like the devices' queues, by disabling
+       interrupts. */
+    struct block_request *active;   /* Request in progress, or NULL. */
+    struct ata_disk *active_disk;   /* Disk ACTIVE is for. */
+    size_t done_cnt;                /* Sectors of ACTIVE finished. */
+    size_t command_end;             /* DONE_CNT when this command ends. */
+    size_t pio_cnt;                 /* Sectors output since last interrupt. */
+    bool active_dma;                /* Is this command by DMA? */
+    int next_dev;                   /* Device to serve next. */
+
+    uint16_t bm_base;           /* Bus master I/O port, 0 if none. */
+    struct prd *prdt;           /* PRD table, one page. */
 
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
@@ -85,16 +161,30 @@ static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void select_sector (struct ata_disk *, block_sector_t, size_t cnt);
+static void set_multiple_mode (struct ata_disk *, int sectors);
+static void issue_command (struct channel *, uint8_t command);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
 
 static void wait_until_idle (const struct ata_disk *);
 static bool wait_while_busy (const struct ata_disk *);
+static bool wait_for_data (const struct ata_disk *);
 static void select_device (const struct ata_disk *);
 static void select_device_wait (const struct ata_disk *);
 
+static uint16_t find_bus_master (void);
+static bool dma_buffers_ok (size_t cnt, void **buffers);
+static void build_prdt (struct channel *, size_t cnt, void **buffers);
+static void clear_bm_status (struct channel *, uint8_t bits);
+
+static void ide_submit (void *d_, struct block_request *);
+static void start_request (struct channel *);
+static void start_command (struct channel *);
+static void output_block (struct channel *);
+static void continue_request (struct channel *, uint8_t status);
+
 static void interrupt_handler (struct intr_frame *);
 
 /* Initialize the disk subsystem and detect disks. */
@@ -102,6 +192,7 @@ void
 ide_init (void)
 {
   size_t chan_no;
+  uint16_t bm_base = find_bus_master ();
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
     {
@@ -123,9 +214,21 @@ ide_init (void)
         default:
           NOT_REACHED ();
         }
-      lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+      c->active = NULL;
+      c->active_disk = NULL;
+      c->next_dev = 0;
+
+      /* Each channel has 8 bus master ports and a PRD table. */
+      c->bm_base = 0;
+      c->prdt = NULL;
+      if (bm_base != 0)
+        {
+          c->prdt = palloc_get_page (PAL_ZERO);
+          if (c->prdt != NULL)
+            c->bm_base = bm_base + chan_no * 8;
+        }
 
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +239,9 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->multiple = 0;
+          d->dma = false;
+          list_init (&d->queue);
         }
 
       /* Register interrupt handler. */
@@ -282,12 +388,16 @@ identify_ata_device (struct ata_disk *d)
   input_sector (c, id);
 
   /* Calculate capacity.
-     Read model name and serial number. */
+     Read model name and serial number.
+     Use DMA if both the controller and the disk (IDENTIFY DEVICE
+     word 49, bit 8) support it. */
   capacity = *(uint32_t *) &id[60 * 2];
   model = descramble_ata_string (&id[10 * 2], 20);
   serial = descramble_ata_string (&id[27 * 2], 40);
+  d->dma = c->bm_base != 0 && (id[49 * 2 + 1] & 0x01) != 0;
   snprintf (extra_info, sizeof extra_info,
-            "model \"%s\", serial \"%s\"", model, serial);
+            "model \"%s\", serial \"%s\"%s", model, serial,
+            d->dma ? ", DMA" : "");
 
   /* Disable access to IDE disks over 1 GB, which are likely
      physical IDE disks rather than virtual ones.  If we don't
@@ -303,6 +413,9 @@ identify_ata_device (struct ata_disk *d)
       return;
     }
 
+  /* Transfer as many sectors per interrupt as the disk allows. */
+  set_multiple_mode (d, id[47 * 2] & 0xff);
+
   /* Register. */
   block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
                           &ide_operations, d);
@@ -337,6 +450,29 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
+/* Moves CNT sectors starting at SEC_NO between disk D and
+   BUFFERS, writing if WRITE is true, and waits for the transfer
+   to complete. */
+static void
+ide_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              void **buffers, bool write)
+{
+  struct block_request r;
+  enum intr_level old_level;
+
+  block_request_init (&r, NULL, sec_no, cnt, buffers, write,
+                      BLOCK_IO_DEMAND);
+  old_level = intr_disable ();
+  ide_submit (d, &r);
+  while (!r.completed)
+    {
+      r.waiting = true;
+      sema_down (&r.done);
+      r.waiting = false;
+    }
+  intr_set_level (old_level);
+}
+
 /* Reads sector SEC_NO from disk D into BUFFER, which must have
    room for BLOCK_SECTOR_SIZE bytes.
    Internally synchronizes accesses to disks, so external
@@ -344,16 +480,7 @@ descramble_ata_string (char *string, int size)
 static void
 ide_read (void *d_, block_sector_t sec_no, void *buffer)
 {
-  struct ata_disk *d = d_;
-  struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
-  lock_release (&c->lock);
+  ide_transfer (d_, sec_no, 1, &buffer, false);
 }
 
 /* Write sector SEC_NO to disk D from BUFFER, which must contain
@@ -363,37 +490,365 @@ ide_read (void *d_, block_sector_t sec_no, void *buffer)
    per-disk locking is unneeded. */
 static void
 ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+{
+  ide_transfer (d_, sec_no, 1, (void **) &buffer, true);
+}
+
+/* Reads CNT sectors starting at SEC_NO from disk D into BUFFERS.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_read_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                   void **buffers)
+{
+  ide_transfer (d_, sec_no, cnt, buffers, false);
+}
+
+/* Writes CNT sectors starting at SEC_NO to disk D from BUFFERS.
+   Returns after the disk has acknowledged receiving all of the
+   data.
+   Internally synchronizes accesses to disks, so external
+   per-disk locking is unneeded. */
+static void
+ide_write_multiple (void *d_, block_sector_t sec_no, size_t cnt,
+                    const void **buffers)
+{
+  ide_transfer (d_, sec_no, cnt, (void **) buffers, true);
+}
+
+/* Queues request R for disk D and returns without waiting for
+   it.  When the channel is idle the request starts at once;
+   otherwise the interrupt handler starts it when the request
+   ahead of it is done.  The disk calls block_complete() on R when
+   it is done, from the interrupt handler.
+   R's buffers must be in kernel memory, because they may be
+   accessed from the interrupt handler, in any thread's address
+   space. */
+static void
+ide_submit (void *d_, struct block_request *r)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
-  lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
-  lock_release (&c->lock);
+  enum intr_level old_level;
+  size_t i;
+
+  for (i = 0; i < r->cnt; i++)
+    ASSERT (is_kernel_vaddr (r->buffers[i]));
+
+  old_level = intr_disable ();
+  list_push_back (&d->queue, &r->elem);
+  if (c->active == NULL)
+    start_request (c);
+  intr_set_level (old_level);
+}
+
+/* Starts the first request queued for one of C's devices, taking
+   turns between the devices, if C is idle.
+   Interrupts must be off. */
+static void
+start_request (struct channel *c)
+{
+  int i;
+
+  ASSERT (intr_get_level () == INTR_OFF);
+  if (c->active != NULL)
+    return;
+
+  for (i = 0; i < 2; i++)
+    {
+      int dev_no = (c->next_dev + i) % 2;
+      struct ata_disk *d = &c->devices[dev_no];
+      if (!list_empty (&d->queue))
+        {
+          c->active = list_entry (list_pop_front (&d->queue),
+                                  struct block_request, elem);
+          c->active_disk = d;
+          c->done_cnt = 0;
+          c->next_dev = !dev_no;
+          start_command (c);
+          return;
+        }
+    }
+}
+
+/* Issues the command for the next MAX_SECTORS_PER_COMMAND or
+   fewer sectors of C's active request, by DMA if possible, else
+   by PIO.  For a PIO write, also outputs the first sectors.
+   Interrupts must be off. */
+static void
+start_command (struct channel *c)
+{
+  struct block_request *r = c->active;
+  struct ata_disk *d = c->active_disk;
+  block_sector_t sec_no = r->sector + c->done_cnt;
+  void **buffers = r->buffers + c->done_cnt;
+  size_t n = r->cnt - c->done_cnt;
+
+  if (n > MAX_SECTORS_PER_COMMAND)
+    n = MAX_SECTORS_PER_COMMAND;
+  c->command_end = c->done_cnt + n;
+  c->active_dma = d->dma && dma_buffers_ok (n, buffers);
+
+  if (c->active_dma)
+    {
+      uint8_t direction = r->write ? 0 : BM_CMD_READ;
+
+      build_prdt (c, n, buffers);
+      outl (reg_bm_prdt (c), vtop (c->prdt));
+      outb (reg_bm_command (c), direction);
+      clear_bm_status (c, BM_STA_ERR | BM_STA_INTR);
+
+      select_sector (d, sec_no, n);
+      issue_command (c, r->write ? CMD_WRITE_DMA : CMD_READ_DMA);
+      outb (reg_bm_command (c), direction | BM_CMD_START);
+    }
+  else
+    {
+      select_sector (d, sec_no, n);
+      if (r->write)
+        {
+          issue_command (c, d->multiple > 0
+                            ? CMD_WRITE_MULTIPLE : CMD_WRITE_SECTOR_RETRY);
+          output_block (c);
+        }
+      else
+        issue_command (c, d->multiple > 0
+                          ? CMD_READ_MULTIPLE : CMD_READ_SECTOR_RETRY);
+    }
+}
+
+/* Outputs the next block of a PIO write on C: as many sectors as
+   the disk takes per interrupt.
+   Interrupts must be off. */
+static void
+output_block (struct channel *c)
+{
+  struct block_request *r = c->active;
+  struct ata_disk *d = c->active_disk;
+  size_t per_intr = d->multiple > 0 ? (size_t) d->multiple : 1;
+  size_t i;
+
+  if (!wait_for_data (d))
+    PANIC ("%s: disk write failed, sector=%"PRDSNu,
+           d->name, r->sector + c->done_cnt);
+  c->pio_cnt = c->command_end - c->done_cnt;
+  if (c->pio_cnt > per_intr)
+    c->pio_cnt = per_intr;
+  for (i = 0; i < c->pio_cnt; i++)
+    output_sector (c, r->buffers[c->done_cnt + i]);
+}
+
+/* Advances C's active request after an interrupt with the given
+   STATUS.  Once the request is done, completes it and starts the
+   next one.
+   Interrupts must be off. */
+static void
+continue_request (struct channel *c, uint8_t status)
+{
+  struct block_request *r = c->active;
+  struct ata_disk *d = c->active_disk;
+
+  if (!c->active_dma && c->bm_base != 0)
+    clear_bm_status (c, BM_STA_INTR);
+  if (c->active_dma)
+    {
+      uint8_t bm_status;
+
+      outb (reg_bm_command (c), r->write ? 0 : BM_CMD_READ);
+      bm_status = inb (reg_bm_status (c));
+      clear_bm_status (c, BM_STA_ERR | BM_STA_INTR);
+      if ((bm_status & BM_STA_ERR) || (status & STA_ERR))
+        PANIC ("%s: DMA %s failed, sector=%"PRDSNu,
+               d->name, r->write ? "write" : "read",
+               r->sector + c->done_cnt);
+      c->done_cnt = c->command_end;
+    }
+  else if (r->write)
+    {
+      if (status & STA_ERR)
+        PANIC ("%s: disk write failed, sector=%"PRDSNu,
+               d->name, r->sector + c->done_cnt);
+      c->done_cnt += c->pio_cnt;
+      if (c->done_cnt < c->command_end)
+        output_block (c);
+    }
+  else
+    {
+      size_t per_intr = d->multiple > 0 ? (size_t) d->multiple : 1;
+      size_t i;
+
+      if ((status & STA_ERR) || !wait_for_data (d))
+        PANIC ("%s: disk read failed, sector=%"PRDSNu,
+               d->name, r->sector + c->done_cnt);
+      for (i = 0; i < per_intr && c->done_cnt < c->command_end; i++)
+        input_sector (c, r->buffers[c->done_cnt++]);
+    }
+
+  if (c->done_cnt < c->command_end)
+    return;
+  if (c->done_cnt < r->cnt)
+    start_command (c);
+  else
+    {
+      c->active = NULL;
+      block_complete (r);
+      start_request (c);
+    }
 }
 
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_multiple,
+    ide_write_multiple,
+    ide_submit
   };
 
+/* Bus master DMA. */
+
+/* Reads a 32-bit register REG from the configuration space of
+   PCI function BUS:DEV.FUNC. */
+static uint32_t
+pci_read_config (int bus, int dev, int func, int reg)
+{
+  outl (PCI_CONFIG_ADDRESS,
+        0x80000000 | (bus << 16) | (dev << 11) | (func << 8) | (reg & 0xfc));
+  return inl (PCI_CONFIG_DATA);
+}
+
+/* Writes DATA to 32-bit register REG in the configuration space
+   of PCI function BUS:DEV.FUNC. */
+static void
+pci_write_config (int bus, int dev, int func, int reg, uint32_t data)
+{
+  outl (PCI_CONFIG_ADDRESS,
+        0x80000000 | (bus << 16) | (dev << 11) | (func << 8) | (reg & 0xfc));
+  outl (PCI_CONFIG_DATA, data);
+}
+
+/* Looks on PCI bus 0 for an IDE controller that can act as a bus
+   master, enables bus mastering on it, and returns the base of
+   its bus master I/O ports.  Returns 0 if there is none. */
+static uint16_t
+find_bus_master (void)
+{
+  int dev, func;
+
+  for (dev = 0; dev < 32; dev++)
+    for (func = 0; func < 8; func++)
+      {
+        uint32_t class, bar4, command;
+
+        if ((pci_read_config (0, dev, func, PCI_REG_ID) & 0xffff) == 0xffff)
+          continue;
+
+        /* Mass storage (0x01), IDE (0x01), bus master capable. */
+        class = pci_read_config (0, dev, func, PCI_REG_CLASS);
+        if ((class >> 16) != 0x0101 || (class & 0x8000) == 0)
+          continue;
+
+        /* BAR4 must be an I/O space address. */
+        bar4 = pci_read_config (0, dev, func, PCI_REG_BAR4);
+        if ((bar4 & 1) == 0 || (bar4 & 0xfffc) == 0)
+          continue;
+
+        command = pci_read_config (0, dev, func, PCI_REG_COMMAND);
+        pci_write_config (0, dev, func, PCI_REG_COMMAND,
+                          (command & 0xffff) | PCI_CMD_IO | PCI_CMD_MASTER);
+        printf ("ide: bus master DMA at port 0x%04"PRIx32"\n", bar4 & 0xfffc);
+        return bar4 & 0xfffc;
+      }
+  return 0;
+}
+
+/* Returns true if the bus master can move data to and from all
+   of the CNT sector-sized BUFFERS: they must be in kernel memory,
+   which is physically contiguous, and dword-aligned. */
+static bool
+dma_buffers_ok (size_t cnt, void **buffers)
+{
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+    if (!is_kernel_vaddr (buffers[i]) || ((uintptr_t) buffers[i] & 3) != 0)
+      return false;
+  return true;
+}
+
+/* Fills in C's PRD table to cover the CNT sector-sized BUFFERS,
+   at most MAX_SECTORS_PER_COMMAND of them.  A buffer takes two
+   entries if it crosses a 64 kB boundary, so the table never
+   overflows. */
+static void
+build_prdt (struct channel *c, size_t cnt, void **buffers)
+{
+  size_t n = 0;
+  size_t i;
+
+  ASSERT (cnt > 0 && cnt <= MAX_SECTORS_PER_COMMAND);
+  for (i = 0; i < cnt; i++)
+    {
+      uintptr_t addr = vtop (buffers[i]);
+      uintptr_t end = addr + BLOCK_SECTOR_SIZE;
+      while (addr < end)
+        {
+          uintptr_t limit = (addr | 0xffff) + 1;
+          uintptr_t stop = end < limit ? end : limit;
+          ASSERT (n < PRD_CNT);
+          c->prdt[n].addr = addr;
+          c->prdt[n].size = stop - addr;
+          c->prdt[n].flags = 0;
+          n++;
+          addr = stop;
+        }
+    }
+  c->prdt[n - 1].flags = PRD_EOT;
+}
+
+/* Clears the write-1-to-clear BITS of C's bus master status
+   register, leaving the drive DMA capable bits alone. */
+static void
+clear_bm_status (struct channel *c, uint8_t bits)
+{
+  outb (reg_bm_status (c), (inb (reg_bm_status (c)) & 0x60) | bits);
+}
+
+/* Asks disk D to interrupt once per SECTORS sectors during READ
+   MULTIPLE and WRITE MULTIPLE, as reported by IDENTIFY DEVICE.
+   Leaves D->multiple at 0, so that multi-sector transfers use
+   READ/WRITE SECTOR instead, if the disk refuses. */
+static void
+set_multiple_mode (struct ata_disk *d, int sectors)
+{
+  struct channel *c = d->channel;
+
+  d->multiple = 0;
+  if (sectors <= 1)
+    return;
+
+  select_device_wait (d);
+  outb (reg_nsect (c), sectors);
+  issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  if ((inb (reg_status (c)) & STA_ERR) == 0)
+    d->multiple = sectors;
+}
+
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and CNT to the disk's sector selection
+   registers.  (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
   ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= MAX_SECTORS_PER_COMMAND);
 
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), (uint8_t) cnt);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -404,14 +859,22 @@ select_sector (struct ata_disk *d, block_sector_t sec_no)
 /* Writes COMMAND to channel C and prepares for receiving a
    completion interrupt. */
 static void
+issue_command (struct channel *c, uint8_t command)
+{
+  c->expecting_interrupt = true;
+  outb (reg_command (c), command);
+}
+
+/* Writes COMMAND to channel C, like issue_command(), for a caller
+   that will wait on completion_wait. */
+static void
 issue_pio_command (struct channel *c, uint8_t command)
 {
   /* Interrupts must be enabled or our semaphore will never be
      up'd by the completion handler. */
   ASSERT (intr_get_level () == INTR_ON);
 
-  c->expecting_interrupt = true;
-  outb (reg_command (c), command);
+  issue_command (c, command);
 }
 
 /* Reads a sector from channel C's data register in PIO mode into
@@ -446,7 +909,7 @@ wait_until_idle (const struct ata_disk *d)
     {
       if ((inb (reg_status (d->channel)) & (STA_BSY | STA_DRQ)) == 0)
         return;
-      timer_usleep (10);
+      timer_udelay (10);
     }
 
   printf ("%s: idle timeout\n", d->name);
@@ -479,6 +942,25 @@ wait_while_busy (const struct ata_disk *d)
   return false;
 }
 
+/* Waits up to 10 ms, without sleeping, for disk D to clear BSY,
+   and then returns the status of the DRQ bit.  Usable with
+   interrupts off, once a command is under way. */
+static bool
+wait_for_data (const struct ata_disk *d)
+{
+  struct channel *c = d->channel;
+  int i;
+
+  for (i = 0; i < 1000; i++)
+    {
+      uint8_t status = inb (reg_alt_status (c));
+      if (!(status & STA_BSY))
+        return (status & STA_DRQ) != 0;
+      timer_udelay (10);
+    }
+  return false;
+}
+
 /* Program D's channel so that D is now the selected disk. */
 static void
 select_device (const struct ata_disk *d)
@@ -489,7 +971,7 @@ select_device (const struct ata_disk *d)
     dev |= DEV_DEV;
   outb (reg_device (c), dev);
   inb (reg_alt_status (c));
-  timer_nsleep (400);
+  timer_ndelay (400);
 }
 
 /* Select disk D in its channel, as select_device(), but wait for
@@ -511,9 +993,16 @@ interrupt_handler (struct intr_frame *f)
   for (c = channels; c < channels + CHANNEL_CNT; c++)
     if (f->vec_no == c->irq)
       {
-        if (c->expecting_interrupt)
+        if (c->expecting_interrupt && c->active != NULL)
+          {
+            uint8_t status = inb (reg_status (c)); /* Acknowledge. */
+            continue_request (c, status);
+          }
+        else if (c->expecting_interrupt)
           {
             inb (reg_status (c));               /* Acknowledge interrupt. */
+            if (c->bm_base != 0)                /* Clear bus master flag. */
+              clear_bm_status (c, BM_STA_INTR);
             sema_up (&c->completion_wait);      /* Wake up waiter. */
           }
         else
@@ -11,6 +11,10 @@ struct partition
   {
     struct block *block;                /* Underlying block device. */
     block_sector_t start;               /* First sector within device. */
+
+    /* Requests forwarded to BLOCK by partition_submit(), each
+       free while completed. */
+    struct block_request children[BLOCK_QUEUE_DEPTH];
   };
 
 static struct block_operations partition_operations;
@@ -22,6 +26,7 @@ static void found_partition (struct block *, uint8_t type,
                              block_sector_t start, block_sector_t size,
                              int part_nr);
 static const char *partition_type_name (uint8_t);
+static void partition_done (struct block_request *, void *parent);
 
 /* Scans BLOCK for partitions of interest to Pintos. */
 void
@@ -171,12 +176,15 @@ found_partition (struct block *block, uint8_t part_type,
       struct partition *p;
       char extra_info[128];
       char name[16];
+      size_t i;
 
       p = malloc (sizeof *p);
       if (p == NULL)
         PANIC ("Failed to allocate memory for partition descriptor");
       p->block = block;
       p->start = start;
+      for (i = 0; i < BLOCK_QUEUE_DEPTH; i++)
+        p->children[i].completed = true;
 
       snprintf (name, sizeof name, "%s%d", block_name (block), part_nr);
       snprintf (extra_info, sizeof extra_info, "%s (%02x)",
@@ -304,7 +312,7 @@ static void
 partition_read (void *p_, block_sector_t sector, void *buffer)
 {
   struct partition *p = p_;
-  block_read (p->block, p->start + sector, buffer);
+  block_read_direct (p->block, p->start + sector, 1, &buffer);
 }
 
 /* Write sector SECTOR to partition P from BUFFER, which must
@@ -314,11 +322,62 @@ static void
 partition_write (void *p_, block_sector_t sector, const void *buffer)
 {
   struct partition *p = p_;
-  block_write (p->block, p->start + sector, buffer);
+  block_write_direct (p->block, p->start + sector, 1, &buffer);
+}
+
+/* Reads CNT sectors starting at SECTOR from partition P into
+   BUFFERS. */
+static void
+partition_read_multiple (void *p_, block_sector_t sector, size_t cnt,
+                         void **buffers)
+{
+  struct partition *p = p_;
+  block_read_direct (p->block, p->start + sector, cnt, buffers);
+}
+
+/* Writes CNT sectors starting at SECTOR to partition P from
+   BUFFERS. */
+static void
+partition_write_multiple (void *p_, block_sector_t sector, size_t cnt,
+                          const void **buffers)
+{
+  struct partition *p = p_;
+  block_write_direct (p->block, p->start + sector, cnt, buffers);
+}
+
+/* Forwards request R for partition P to the underlying device,
+   in R's scheduling class, and returns without waiting for it.
+   Partitions are only found on IDE disks, which complete
+   requests asynchronously too. */
+static void
+partition_submit (void *p_, struct block_request *r)
+{
+  struct partition *p = p_;
+  struct block_request *child = p->children;
+
+  while (child < p->children + BLOCK_QUEUE_DEPTH && !child->completed)
+    child++;
+  ASSERT (child < p->children + BLOCK_QUEUE_DEPTH);
+
+  block_request_init (child, p->block, p->start + r->sector, r->cnt,
+                      r->buffers, r->write, r->class);
+  child->callback = partition_done;
+  child->aux = r;
+  block_submit (child);
+}
+
+/* Completes PARENT, the partition request that CHILD carried. */
+static void
+partition_done (struct block_request *child UNUSED, void *parent)
+{
+  block_complete (parent);
 }
 
 static struct block_operations partition_operations =
   {
     partition_read,
-    partition_write
+    partition_write,
+    partition_read_multiple,
+    partition_write_multiple,
+    partition_submit
   };
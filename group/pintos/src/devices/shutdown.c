@@ -56,6 +56,9 @@ shutdown_configure (enum shutdown_type type)
 void
 shutdown_reboot (void)
 {
+#ifdef FILESYS
+  filesys_sync ();
+#endif
   flush_cache ();
   printf ("Rebooting...\n");
 
@@ -98,6 +98,16 @@ timer_elapsed (int64_t then)
   return timer_ticks () - then;
 }
 
+/* Returns the processor's time-stamp counter, for measuring
+   intervals much shorter than a tick. */
+uint64_t
+timer_cycles (void)
+{
+  uint64_t tsc;
+  asm volatile ("rdtsc" : "=A" (tsc));
+  return tsc;
+}
+
 /* Sleeps for approximately TICKS timer ticks.  Interrupts must
    be turned on. */
 void
@@ -110,22 +110,30 @@ static bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp)
 {
-  struct dir_entry e;
-  size_t ofs;
+  const struct dir_entry *e;
+  struct cache_block *pin;
+  off_t ofs, cnt;
+  size_t i;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e)
-    if (e.inode != 0 && !strcmp (name, e.name))
-      {
-        if (ep != NULL)
-          *ep = e;
-        if (ofsp != NULL)
-          *ofsp = ofs;
-        return true;
-      }
+  /* Scan the entries a sector at a time, in the buffer cache. */
+  for (ofs = 0; (e = inode_pin_at (dir->inode, ofs, &cnt, &pin)) != NULL;
+       ofs += cnt)
+    {
+      for (i = 0; i < cnt / sizeof *e; i++)
+        if (e[i].inode != 0 && !strcmp (name, e[i].name))
+          {
+            if (ep != NULL)
+              *ep = e[i];
+            if (ofsp != NULL)
+              *ofsp = ofs + i * sizeof *e;
+            dcache_unpin (pin, false);
+            return true;
+          }
+      dcache_unpin (pin, false);
+    }
   return false;
 }
 
@@ -321,7 +329,9 @@ mkdir (const char *dir)
       if (success == 0 && !last_exists) {
 
         /* Malloc a new block for the directory. */
-        if (!free_map_allocate (1, &new_block))
+        if (!free_map_allocate_near (1,
+                                     inode_get_inumber (dir_get_inode (curr)),
+                                     &new_block))
         {
            dir_close (curr);
            return false;
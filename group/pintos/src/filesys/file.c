@@ -119,6 +119,18 @@ file_write_at (struct file *file, const void *buffer, off_t size,
   return inode_write_at (file->inode, buffer, size, file_ofs);
 }
 
+/* Sets the length of FILE to LENGTH bytes, freeing whatever lies
+   past a new, smaller end, or extending FILE with zeros.  The
+   file's position is unaffected.
+   Returns true if successful, false if writes to FILE are denied
+   or LENGTH is out of range. */
+bool
+file_truncate (struct file *file, off_t length)
+{
+  ASSERT (file != NULL);
+  return inode_resize (file->inode, length);
+}
+
 /* Prevents write operations on FILE's underlying inode
    until file_allow_write() is called or FILE is closed. */
 void
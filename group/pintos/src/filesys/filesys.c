@@ -32,6 +32,7 @@ filesys_init (bool format)
 
   free_map_open ();
   thread_current ()->cwd = dir_open_root ();
+  cache_set_sync_hook (filesys_sync);
 }
 
 /* Shuts down the file system module, writing any unwritten data
@@ -39,10 +40,22 @@ filesys_init (bool format)
 void
 filesys_done (void)
 {
+  cache_set_sync_hook (NULL);
+  inode_flush_all ();
   free_map_close ();
   flush_cache ();
 }
 
+/* Writes the in-memory inodes and free map that changed to the
+   buffer cache, which writes them to disk in its next write-behind
+   pass.  Otherwise they would reach the disk only when closed. */
+void
+filesys_sync (void)
+{
+  inode_flush_all ();
+  free_map_flush ();
+}
+
 /* Creates a file named NAME with the given INITIAL_SIZE.
    Returns true if successful, false otherwise.
    Fails if a file named NAME already exists,
@@ -99,7 +112,9 @@ filesys_create (const char *name, off_t initial_size)
       if (success == 0 && !last_exists) {
 
         /* Malloc a new block for the file. */
-        if (!free_map_allocate (1, &new_block))
+        if (!free_map_allocate_near (1,
+                                     inode_get_inumber (dir_get_inode (curr)),
+                                     &new_block))
         {
           dir_close (curr);
           return false;
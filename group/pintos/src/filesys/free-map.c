@@ -1,20 +1,41 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
+#include <stdlib.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "threads/malloc.h"
 #include "threads/synch.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct bitmap *dirty_sectors; /* Sectors of the free map file that
+                                        differ from FREE_MAP. */
 
+/* Bits of FREE_MAP held in one sector of its file. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
+
+/* Sectors per region.  The free map keeps a count of the free
+   sectors in each region so that searches can skip full ones. */
+#define REGION_BITS BITS_PER_SECTOR
+
+static size_t free_cnt;              /* Free sectors in FREE_MAP. */
+static uint16_t *region_free;        /* Free sectors in each region. */
+static size_t cursor;                /* Where the last allocation ended. */
 
 struct lock free_map_lock;
 bool free_map_has_space (size_t cnt);
-bool freemap_set_bits (size_t sectors, void* buffer);
-bool free_map_request (size_t sectors, void* buffer);
-void block_free (size_t sector);
+static size_t allocate_extent (size_t cnt, block_sector_t goal,
+                               block_sector_t *sectors);
+static size_t allocate_run (size_t cnt, block_sector_t goal);
+static size_t find_run (size_t start, size_t cnt);
+static void set_used (size_t start, size_t cnt, bool used);
+static void count_free (void);
+static int compare_sectors (const void *, const void *);
+static void mark_dirty (size_t start, size_t cnt);
+static bool write_dirty (void);
 
 /* Initializes the free map. */
 void
@@ -23,30 +44,44 @@ free_map_init (void)
   free_map = bitmap_create (block_size (fs_device));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
+  dirty_sectors = bitmap_create (DIV_ROUND_UP (bitmap_size (free_map),
+                                               BITS_PER_SECTOR));
+  region_free = malloc (DIV_ROUND_UP (bitmap_size (free_map), REGION_BITS)
+                        * sizeof *region_free);
+  if (dirty_sectors == NULL || region_free == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  count_free ();
   lock_init (&free_map_lock);
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
-   the first into *SECTORP.
+   the first into *SECTORP.  The search starts where the previous
+   allocation ended rather than at the start of the disk.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available. */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
   lock_acquire (&free_map_lock);
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
-    {
-      // bitmap_write failed. So undo the changes to the free_map
-      bitmap_set_multiple (free_map, sector, cnt, false);
-      sector = BITMAP_ERROR;
-    }
+  block_sector_t sector = allocate_run (cnt, cursor);
+  lock_release (&free_map_lock);
+  if (sector != BITMAP_ERROR)
+    *sectorp = sector;
+  return sector != BITMAP_ERROR;
+}
 
+/* Like free_map_allocate(), but takes the first run of CNT free
+   sectors at or after GOAL, wrapping around to the start of the
+   disk if there is none, so that related data ends up close
+   together. */
+bool
+free_map_allocate_near (size_t cnt, block_sector_t goal,
+                        block_sector_t *sectorp)
+{
+  lock_acquire (&free_map_lock);
+  block_sector_t sector = allocate_run (cnt, goal);
   lock_release (&free_map_lock);
   if (sector != BITMAP_ERROR)
     *sectorp = sector;
@@ -58,12 +93,210 @@ void
 free_map_release (block_sector_t sector, size_t cnt)
 {
   lock_acquire (&free_map_lock);
-  ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  set_used (sector, cnt, false);
+  lock_release (&free_map_lock);
+}
+
+/* Makes the CNT sectors in SECTORS, in any order, available for
+   use, with a single hold of the free map lock.  Sorts SECTORS so
+   that sectors that are next to each other on disk are released
+   as one run. */
+void
+free_map_release_sectors (block_sector_t *sectors, size_t cnt)
+{
+  size_t i = 0;
+
+  qsort (sectors, cnt, sizeof *sectors, compare_sectors);
+  lock_acquire (&free_map_lock);
+  while (i < cnt)
+    {
+      size_t len = 1;
+      while (i + len < cnt && sectors[i + len] == sectors[i] + len)
+        len++;
+      set_used (sectors[i], len, false);
+      i += len;
+    }
+  lock_release (&free_map_lock);
+}
+
+/* Orders sectors A and B for qsort(). */
+static int
+compare_sectors (const void *a_, const void *b_)
+{
+  const block_sector_t *a = a_;
+  const block_sector_t *b = b_;
+
+  return *a < *b ? -1 : *a > *b;
+}
+
+/* Marks the first run of CNT free sectors at or after GOAL, or
+   failing that after the start of the disk, as used and returns
+   its first sector, or BITMAP_ERROR if there is no such run.
+   Assumes thread_current owns free_map_lock. */
+static size_t
+allocate_run (size_t cnt, block_sector_t goal)
+{
+  size_t sector;
+
+  if (cnt > free_cnt)
+    return BITMAP_ERROR;
+  if (goal >= bitmap_size (free_map))
+    goal = 0;
+  sector = find_run (goal, cnt);
+  if (sector == BITMAP_ERROR && goal > 0)
+    sector = find_run (0, cnt);
+  if (sector != BITMAP_ERROR)
+    set_used (sector, cnt, true);
+  return sector;
+}
+
+/* Returns the first sector of the first run of CNT free sectors
+   at or after START, or BITMAP_ERROR if there is none.  Unlike
+   bitmap_scan(), looks at each sector once and skips regions
+   without any free sectors.
+   Assumes thread_current owns free_map_lock. */
+static size_t
+find_run (size_t start, size_t cnt)
+{
+  size_t bit_cnt = bitmap_size (free_map);
+  size_t run = 0;
+  size_t i = start;
+
+  if (cnt == 0)
+    return start;
+  while (i < bit_cnt)
+    if (region_free[i / REGION_BITS] == 0)
+      {
+        run = 0;
+        i = ROUND_DOWN (i, REGION_BITS) + REGION_BITS;
+      }
+    else
+      {
+        if (bitmap_test (free_map, i))
+          run = 0;
+        else if (++run == cnt)
+          return i + 1 - cnt;
+        i++;
+      }
+  return BITMAP_ERROR;
+}
+
+/* Sets sectors START through START + CNT - 1, which must all be
+   !USED, to USED, and updates the free counts to match.
+   Assumes thread_current owns free_map_lock. */
+static void
+set_used (size_t start, size_t cnt, bool used)
+{
+  size_t end = start + cnt;
+  size_t i;
+
+  ASSERT (used ? bitmap_none (free_map, start, cnt)
+               : bitmap_all (free_map, start, cnt));
+  if (cnt == 0)
+    return;
+
+  bitmap_set_multiple (free_map, start, cnt, used);
+  for (i = start; i < end; )
+    {
+      size_t r = i / REGION_BITS;
+      size_t n = (r + 1) * REGION_BITS;
+      if (n > end)
+        n = end;
+      n -= i;
+      if (used)
+        region_free[r] -= n;
+      else
+        region_free[r] += n;
+      i += n;
+    }
+  if (used)
+    {
+      free_cnt -= cnt;
+      cursor = end;
+    }
+  else
+    free_cnt += cnt;
+  mark_dirty (start, cnt);
+}
+
+/* Recomputes the free counts from the free map. */
+static void
+count_free (void)
+{
+  size_t bit_cnt = bitmap_size (free_map);
+  size_t start;
+
+  free_cnt = 0;
+  for (start = 0; start < bit_cnt; start += REGION_BITS)
+    {
+      size_t cnt = bit_cnt - start < REGION_BITS ? bit_cnt - start
+                                                 : REGION_BITS;
+      region_free[start / REGION_BITS] = bitmap_count (free_map, start,
+                                                       cnt, false);
+      free_cnt += region_free[start / REGION_BITS];
+    }
+}
+
+/* Writes the sectors of the free map file that changed since they
+   were last written.  Allocation and release only update the map
+   in memory, so this is all the free map I/O there is between
+   free_map_open() and free_map_close(). */
+void
+free_map_flush (void)
+{
+  if (free_map == NULL)
+    return;
+  lock_acquire (&free_map_lock);
+  if (free_map_file != NULL && !write_dirty ())
+    PANIC ("can't write free map");
   lock_release (&free_map_lock);
 }
 
+/* Records that bits START through START + CNT - 1 of the free map
+   changed.
+   Assumes thread_current owns free_map_lock. */
+static void
+mark_dirty (size_t start, size_t cnt)
+{
+  size_t first = start / BITS_PER_SECTOR;
+  size_t last = (start + cnt - 1) / BITS_PER_SECTOR;
+
+  ASSERT (cnt > 0);
+  bitmap_set_multiple (dirty_sectors, first, last - first + 1, true);
+}
+
+/* Writes each run of dirty sectors of the free map file with one
+   call.  Returns true if successful, false otherwise.
+   Assumes thread_current owns free_map_lock. */
+static bool
+write_dirty (void)
+{
+  size_t bit_cnt = bitmap_size (free_map);
+  size_t sector_cnt = bitmap_size (dirty_sectors);
+  size_t first = 0;
+
+  while ((first = bitmap_scan (dirty_sectors, first, 1, true))
+         != BITMAP_ERROR)
+    {
+      size_t last = first + 1;
+      size_t start = first * BITS_PER_SECTOR;
+      size_t end;
+
+      while (last < sector_cnt && bitmap_test (dirty_sectors, last))
+        last++;
+      end = last * BITS_PER_SECTOR;
+      if (end > bit_cnt)
+        end = bit_cnt;
+      if (!bitmap_write_range (free_map, free_map_file, start, end - start))
+        return false;
+      bitmap_set_multiple (dirty_sectors, first, last - first, false);
+      first = last;
+      if (first >= sector_cnt)
+        break;
+    }
+  return true;
+}
+
 /* Opens the free map file and reads it from disk. */
 void
 free_map_open (void)
@@ -74,6 +307,7 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  count_free ();
   lock_release (&free_map_lock);
 }
 
@@ -82,6 +316,8 @@ void
 free_map_close (void)
 {
   lock_acquire (&free_map_lock);
+  if (!write_dirty ())
+    PANIC ("can't write free map");
   file_close (free_map_file);
   free_map_file = NULL;
   lock_release (&free_map_lock);
@@ -102,49 +338,78 @@ free_map_create (void)
     PANIC ("can't open free map");
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
+  bitmap_set_all (dirty_sectors, false);
 }
 
 /* Checks whether free_map has enough memory to allocate CNT sectors. */
 bool
 free_map_has_space (size_t cnt)
 {
-  return cnt <= bitmap_count_all (free_map, false);
+  return cnt <= free_cnt;
 }
 
-/*
-  Sets SECTORS bits to FALSE on the FREEMAP if there is enough free bits.
-*/
+/* Allocates SECTORS sectors, not necessarily consecutive, and
+   stores them into BUFFER in the order a file should use them.
+   They are taken as a few extents, runs of consecutive sectors,
+   as close after GOAL as possible, so that a file grown with GOAL
+   just past its last sector stays contiguous on disk.
+   Returns true if successful, false if there is not enough free
+   space. */
 bool
-freemap_set_bits (size_t sectors, void* buffer)
+free_map_request (size_t sectors, block_sector_t goal,
+                  block_sector_t *buffer)
 {
-  if (!free_map_has_space (sectors))
-    return false;
-  bitmap_set_any (free_map, 0, sectors, true, buffer);
-  return true;
-}
-
+  size_t cnt = 0;
+  bool success;
 
-
-bool
-free_map_request (size_t sectors, void* buffer)
-{
   lock_acquire (&free_map_lock);
-  bool success = freemap_set_bits (sectors, buffer);
-  if (success
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
-  {
-    bitmap_set_sectors (free_map, buffer, sectors, false);
-    success = false;
-  }
+  success = free_map_has_space (sectors);
+  if (success)
+    while (cnt < sectors)
+      {
+        size_t got = allocate_extent (sectors - cnt, goal, buffer + cnt);
+        cnt += got;
+        goal = buffer[cnt - 1] + 1;
+      }
   lock_release (&free_map_lock);
   return success;
 }
 
-void
-block_free (size_t sector)
+/* Allocates one extent of at most CNT free sectors near GOAL and
+   stores its sectors into SECTORS.  In order of preference, the
+   extent continues from GOAL itself, is the first run of CNT free
+   sectors after GOAL, or is the first run of any free sectors
+   after GOAL, wrapping around to the start of the disk in the
+   last two cases.  Returns the extent's length.
+   Assumes thread_current owns free_map_lock and that at least
+   one sector is free. */
+static size_t
+allocate_extent (size_t cnt, block_sector_t goal, block_sector_t *sectors)
 {
-  lock_acquire (&free_map_lock);
-  bitmap_mark (free_map, sector);
-  lock_release (&free_map_lock);
+  size_t bit_cnt = bitmap_size (free_map);
+  size_t start, len, i;
+
+  if (goal >= bit_cnt)
+    goal = 0;
+  if (!bitmap_test (free_map, goal))
+    start = goal;
+  else
+    {
+      start = find_run (goal, cnt);
+      if (start == BITMAP_ERROR)
+        start = find_run (0, cnt);
+      if (start == BITMAP_ERROR)
+        start = find_run (goal, 1);
+      if (start == BITMAP_ERROR)
+        start = find_run (0, 1);
+      ASSERT (start != BITMAP_ERROR);
+    }
+
+  for (len = 1; len < cnt && start + len < bit_cnt; len++)
+    if (bitmap_test (free_map, start + len))
+      break;
+  set_used (start, len, true);
+  for (i = 0; i < len; i++)
+    sectors[i] = start + i;
+  return len;
 }
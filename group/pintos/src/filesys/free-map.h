@@ -12,9 +12,12 @@ void free_map_open (void);
 void free_map_close (void);
 
 bool free_map_allocate (size_t, block_sector_t *);
+bool free_map_allocate_near (size_t, block_sector_t goal, block_sector_t *);
 void free_map_release (block_sector_t, size_t);
+void free_map_release_sectors (block_sector_t *sectors, size_t cnt);
+void free_map_flush (void);
 
-bool free_map_request (size_t sectors, void* buffer);
-void block_free (size_t sector);
+bool free_map_request (size_t sectors, block_sector_t goal,
+                       block_sector_t *buffer);
 
 #endif /* filesys/free-map.h */
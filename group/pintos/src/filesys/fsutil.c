@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <round.h>
 #include <ustar.h>
 #include "filesys/directory.h"
 #include "filesys/file.h"
@@ -78,7 +79,7 @@ fsutil_extract (char **argv UNUSED)
 
   /* Allocate buffers. */
   header = malloc (BLOCK_SECTOR_SIZE);
-  data = malloc (BLOCK_SECTOR_SIZE);
+  data = palloc_get_page (0);
   if (header == NULL || data == NULL)
     PANIC ("couldn't allocate buffers");
 
@@ -123,13 +124,14 @@ fsutil_extract (char **argv UNUSED)
           if (dst == NULL)
             PANIC ("%s: open failed", file_name);
 
-          /* Do copy. */
+          /* Do copy, a page of sectors per read. */
           while (size > 0)
             {
-              int chunk_size = (size > BLOCK_SECTOR_SIZE
-                                ? BLOCK_SECTOR_SIZE
-                                : size);
-              block_read (src, sector++, data);
+              int chunk_size = size > PGSIZE ? PGSIZE : size;
+              size_t chunk_sectors = DIV_ROUND_UP (chunk_size,
+                                                   BLOCK_SECTOR_SIZE);
+              block_read_multiple (src, sector, chunk_sectors, data);
+              sector += chunk_sectors;
               if (file_write (dst, data, chunk_size) != chunk_size)
                 PANIC ("%s: write failed with %d bytes unwritten",
                        file_name, size);
@@ -150,7 +152,7 @@ fsutil_extract (char **argv UNUSED)
   block_write (src, 0, header);
   block_write (src, 1, header);
 
-  free (data);
+  palloc_free_page (data);
   free (header);
 }
 
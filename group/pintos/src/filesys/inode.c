@@ -1,5 +1,5 @@
 #include "filesys/inode.h"
-#include <list.h>
+#include <hash.h>
 #include <debug.h>
 #include <round.h>
 #include <string.h>
@@ -12,27 +12,70 @@
 #define INODE_MAGIC 0x494e4f44
 
 struct inode_disk;
-void zero_out_inode_disk (struct inode* inode, struct inode_disk* disk_inode, off_t size, off_t offset);
+struct pointer_block;
 const size_t DIRECT_POINTERS = 124;
 const size_t SECTORS_PER_BLOCK = BLOCK_SECTOR_SIZE / sizeof (block_sector_t);
 const size_t MAX_FILE_SIZE = (8 * (1 << 20)) - (3 + 128) * 512;
-bool inode_disk_resize (struct inode_disk* id, size_t size, void* buff_,
-                    size_t total_sectors);
+
+/* A sector of zeros, for reading and filling holes. */
+static const uint8_t zeros[BLOCK_SECTOR_SIZE];
 
 size_t calculate_additional_sectors (size_t curr_size, size_t new_size);
-bool inode_resize (struct inode_disk *id, size_t new_size, block_sector_t);
+static block_sector_t lookup_sector (struct inode *inode, uint32_t pos);
+static bool allocate_range (struct inode *inode, off_t start, off_t end);
+static size_t count_holes (struct inode *inode, size_t first, size_t last);
+static struct pointer_block *load_map (struct inode *inode, int level,
+                                       block_sector_t *slot,
+                                       const block_sector_t *sectors,
+                                       size_t *next, bool dirty[2]);
+static void flush_map (struct inode *inode, int level, bool dirty[2]);
+static void inode_read_ahead (struct inode *inode, off_t offset, off_t size,
+                              off_t length);
+static block_sector_t read_pointer (struct inode *inode, int level,
+                                    block_sector_t sector, size_t index);
+static void inode_flush (struct inode *inode);
+static void forget_map (struct inode *inode);
+static void release_blocks (struct inode *inode);
+static bool promote_inline (struct inode *inode);
+static bool fits_in_place (struct inode *inode, off_t size, off_t offset);
+static void release_lock (struct inode *inode, bool shared);
+struct sector_batch;
+static void truncate_blocks (struct inode *inode, size_t keep,
+                             struct sector_batch *batch);
+
+/* Read-ahead window bounds, in sectors. */
+#define READ_AHEAD_MIN 2
+#define READ_AHEAD_MAX 32
 
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
 struct inode_disk
   {
-    uint32_t is_dir;
+    uint16_t is_dir;
+    uint16_t flags;                     /* INODE_* flags. */
     uint32_t size;
-    block_sector_t direct[124];
-    block_sector_t single_indirect;
-    block_sector_t double_indirect;
+    union
+      {
+        /* Block map. */
+        struct
+          {
+            block_sector_t direct[124];
+            block_sector_t single_indirect;
+            block_sector_t double_indirect;
+          };
+
+        /* The file's bytes, if INODE_INLINE.  Bytes past SIZE are
+           zero. */
+        uint8_t inline_data[126 * sizeof (block_sector_t)];
+      };
   };
 
+/* inode_disk flags. */
+#define INODE_INLINE 0x1                /* Data is in inline_data. */
+
+/* Largest file whose data fits in the inode sector. */
+#define INLINE_MAX ((off_t) sizeof ((struct inode_disk *) 0)->inline_data)
+
 struct pointer_block
   {
     block_sector_t pointer[128];
@@ -49,82 +92,199 @@ bytes_to_sectors (off_t size)
 /* In-memory inode. */
 struct inode
   {
-    struct lock lock;                   /* A lock to ensure no data races. */
+    struct rw_lock lock;                /* Held to read by readers and by
+                                           writers that stay within the
+                                           file's sectors, to write by
+                                           anything else. */
+    struct lock map_lock;               /* Protects the translation cache
+                                           and read-ahead state, which
+                                           readers sharing LOCK update. */
     bool is_dir;                        /* Is this inode a directory or not? */
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open_inodes. */
+    struct list_elem flush_elem;        /* Element in inode_flush_all()'s
+                                           list, see flush_all_lock. */
     block_sector_t sector;              /* Sector number of disk location. */
-    int open_cnt;                       /* Number of openers. */
+    int open_cnt;                       /* Number of openers, protected
+                                           by open_inodes_lock.  0 while
+                                           the last closer writes it
+                                           back. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
-    // struct inode_disk data;             /* Inode content. */
+    off_t ra_next;                      /* Where a sequential read resumes. */
+    off_t ra_end;                       /* Read-ahead queued up to here. */
+    size_t ra_window;                   /* Sectors to read ahead, 0 if random. */
+    bool dirty;                         /* DATA not yet written back? */
+    struct inode_disk data;             /* Inode content. */
+
+    /* Translation cache for byte_to_sector: the last pointer block
+       read at each level, the single or double indirect block at
+       level 0 and a block under the double indirect one at level
+       1.  MAP_SECTOR is 0 for an empty slot.  Changing the block
+       map itself, rather than just which blocks are cached here,
+       takes LOCK held to write. */
+    block_sector_t map_sector[2];
+    struct pointer_block map[2];
   };
 
+/* Returns true if INODE keeps its data inline, in its on-disk
+   inode, instead of in blocks of its own.  Only files that have
+   never been longer than INLINE_MAX bytes do. */
+static inline bool
+is_inline (const struct inode *inode)
+{
+  return (inode->data.flags & INODE_INLINE) != 0;
+}
+
 /* Returns the block device sector that contains byte offset POS
-   within INODE.
+   within INODE, or 0 if POS is in a hole, a part of INODE that
+   has never been written and reads as zeros.
    Returns -1 if INODE does not contain data for a byte at offset
-   POS. */
+   POS.
+   Assumes thread_current holds INODE's lock. */
 static block_sector_t
 byte_to_sector (struct inode *inode, uint32_t pos)
 {
-  uint8_t block[512];
-
   ASSERT (inode != NULL);
 
-  /* Read inode->sector into block. */
-  block_read(fs_device, inode->sector, block);
-
   /* Check if the pos is in bounds. */
-  if (pos >= ((struct inode_disk*) block)->size) {
+  if (pos >= inode->data.size)
     return -1;
-  }
+  return lookup_sector (inode, pos);
+}
+
+/* Like byte_to_sector(), but without the check against INODE's
+   length, so that it also works for a write past the end. */
+static block_sector_t
+lookup_sector (struct inode *inode, uint32_t pos)
+{
+  const struct inode_disk *disk_inode = &inode->data;
+  block_sector_t sector;
+
+  ASSERT (!is_inline (inode));
 
   /* If it's in the direct block, return the corresponding block. */
-  if (pos < 124 * BLOCK_SECTOR_SIZE) {
-    return ((struct inode_disk*) block)->direct[pos / BLOCK_SECTOR_SIZE];
-  }
+  if (pos < 124 * BLOCK_SECTOR_SIZE)
+    return disk_inode->direct[pos / BLOCK_SECTOR_SIZE];
 
   /* If it's past the direct block, subtract off the part and check indirect. */
   pos -= 124 * BLOCK_SECTOR_SIZE;
-  if (pos < BLOCK_SECTOR_SIZE * 128) {
-
-    /* Read inode_disk->indirect into block. */
-    block_read(fs_device, ((struct inode_disk*) block)->single_indirect, block);
-    return ((struct pointer_block*) block)->pointer[pos / 512];
-  }
+  if (pos < BLOCK_SECTOR_SIZE * 128)
+    return read_pointer (inode, 0, disk_inode->single_indirect, pos / 512);
 
   /* Finally, find the appropriate doubly-indirect block. */
   pos -= 128 * BLOCK_SECTOR_SIZE;
+  sector = disk_inode->double_indirect;
   if (pos < 16384 * BLOCK_SECTOR_SIZE) {
-
-    /* Read inode_disk->double_indirect into block. */
-    block_read(fs_device, ((struct inode_disk*) block)->double_indirect, block);
-
-    /* Read inode_disk->pointer[pos / 65536] into block. */
-    block_read(fs_device, ((struct pointer_block*) block)->pointer[pos / 65536], block);
-    return ((struct pointer_block*) block)->pointer[pos / 512];
+    sector = read_pointer (inode, 0, sector, pos / 65536);
+    return read_pointer (inode, 1, sector, (pos / 512) % SECTORS_PER_BLOCK);
   }
 
   PANIC("position is past the end of max filesize.");
   return -1;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Returns entry INDEX of the pointer block in SECTOR, which is
+   at LEVEL of INODE's block map, reading the block into INODE's
+   translation cache unless it is already there.  Returns 0 if
+   SECTOR is 0, meaning that the pointer block is a hole too.
+   Assumes thread_current holds INODE's lock. */
+static block_sector_t
+read_pointer (struct inode *inode, int level, block_sector_t sector,
+              size_t index)
+{
+  block_sector_t pointer;
+
+  if (sector == 0)
+    return 0;
+  lock_acquire (&inode->map_lock);
+  if (inode->map_sector[level] != sector)
+    {
+      block_read (fs_device, sector, &inode->map[level]);
+      inode->map_sector[level] = sector;
+    }
+  pointer = inode->map[level].pointer[index];
+  lock_release (&inode->map_lock);
+  return pointer;
+}
+
+/* Empties INODE's translation cache, after its pointer blocks
+   have changed.
+   Assumes thread_current holds INODE's lock to write. */
+static void
+forget_map (struct inode *inode)
+{
+  inode->map_sector[0] = inode->map_sector[1] = 0;
+}
+
+/* Writes INODE's on-disk inode back to the cache if it has
+   changed since it was read.
+   Assumes thread_current holds INODE's lock to write. */
+static void
+inode_flush (struct inode *inode)
+{
+  if (inode->dirty)
+    {
+      block_write (fs_device, inode->sector, &inode->data);
+      inode->dirty = false;
+    }
+}
+
+/* Open inodes, indexed by sector, so that opening a single inode
+   twice returns the same `struct inode'.  OPEN_INODES_LOCK also
+   protects each inode's open_cnt, so that an inode found in the
+   table cannot be freed before its new opener is counted.
+
+   The last closer leaves its inode in the table, with an open_cnt
+   of 0, until the inode is written back, so that nobody reads the
+   old copy from disk in the meantime.  Openers that find such an
+   inode wait on INODE_CLOSED and look again. */
+static struct hash open_inodes;
+static struct lock open_inodes_lock;
+static struct condition inode_closed;
+
+/* Serializes inode_flush_all(), which collects inodes on a list
+   through their flush_elem. */
+static struct lock flush_all_lock;
+
+/* Search key for open_inodes.  A struct inode is too big for the
+   stack, so there is one, protected by open_inodes_lock. */
+static struct inode open_inodes_key;
+
+/* Hashes an open inode by its sector. */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int ((int) hash_entry (e, struct inode, elem)->sector);
+}
+
+/* Orders open inodes by sector. */
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return (hash_entry (a, struct inode, elem)->sector
+          < hash_entry (b, struct inode, elem)->sector);
+}
 
 /* Initializes the inode module. */
 void
 inode_init (void)
 {
-  list_init (&open_inodes);
+  if (!hash_init (&open_inodes, inode_hash, inode_less, NULL))
+    PANIC ("can't create open inode table");
+  lock_init (&open_inodes_lock);
+  cond_init (&inode_closed);
+  lock_init (&flush_all_lock);
   ASSERT (sizeof (struct inode_disk) == BLOCK_SECTOR_SIZE);
 }
 
-/* Initializes a new empty inode and writes the new
-   inode to sector SECTOR on the file system
-   device.
+/* Initializes an inode with INITIAL_SIZE bytes of data, all of
+   it a hole, and writes the new inode to sector SECTOR on the
+   file system device.  A file small enough starts out with its
+   data inline.
    Returns true if successful.
-   Returns false if memory or disk allocation fails. */
+   Returns false if memory allocation fails or INITIAL_SIZE is
+   larger than a file can be. */
 bool
 inode_create (block_sector_t sector, off_t initial_size, bool isdir)
 {
@@ -136,8 +296,12 @@ inode_create (block_sector_t sector, off_t initial_size, bool isdir)
   if (disk_inode == NULL)
     return false;
   disk_inode->is_dir = isdir;
-  disk_inode->size = 0;
-  bool success = inode_resize (disk_inode, initial_size, sector);
+  disk_inode->size = initial_size;
+  if (!isdir && initial_size <= INLINE_MAX)
+    disk_inode->flags = INODE_INLINE;
+  bool success = (size_t) initial_size <= MAX_FILE_SIZE;
+  if (success)
+    block_write (fs_device, sector, disk_inode);
   free (disk_inode);
   return success;
 }
@@ -148,38 +312,66 @@ inode_create (block_sector_t sector, off_t initial_size, bool isdir)
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
   struct inode *inode;
-  struct inode_disk disk_inode;
+  struct hash_elem *e;
 
-  /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e))
+  /* Check whether this inode is already open, waiting out its
+     last closer if it is being closed. */
+  lock_acquire (&open_inodes_lock);
+  for (;;)
+    {
+      open_inodes_key.sector = sector;
+      e = hash_find (&open_inodes, &open_inodes_key.elem);
+      inode = e != NULL ? hash_entry (e, struct inode, elem) : NULL;
+      if (inode == NULL || inode->removed || inode->open_cnt > 0)
+        break;
+      cond_wait (&inode_closed, &open_inodes_lock);
+    }
+  if (inode != NULL)
     {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector)
+      if (inode->removed)
+        inode = NULL;
+      else
+        inode->open_cnt++;
+      lock_release (&open_inodes_lock);
+
+      /* Wait for the opener that created INODE to read it in. */
+      if (inode != NULL)
         {
-          if (inode->removed)
-            return NULL;
-          inode_reopen (inode);
-          return inode;
+          rw_lock_acquire_read (&inode->lock);
+          rw_lock_release_read (&inode->lock);
         }
+      return inode;
     }
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
-    return NULL;
+    {
+      lock_release (&open_inodes_lock);
+      return NULL;
+    }
 
-  /* Initialize. */
-  block_read(fs_device, sector, &disk_inode);
-  inode->is_dir = disk_inode.is_dir;
-  list_push_front (&open_inodes, &inode->elem);
+  /* Initialize, and publish the inode locked, so that other
+     openers wait for the read without holding up the table. */
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
-  lock_init(&inode->lock);
+  inode->ra_next = 0;
+  inode->ra_end = 0;
+  inode->ra_window = 0;
+  rw_lock_init (&inode->lock);
+  lock_init (&inode->map_lock);
+  rw_lock_acquire_write (&inode->lock);
+  hash_insert (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
+
+  block_read (fs_device, sector, &inode->data);
+  inode->is_dir = inode->data.is_dir;
+  inode->dirty = false;
+  forget_map (inode);
+  rw_lock_release_write (&inode->lock);
   return inode;
 }
 
@@ -189,9 +381,9 @@ inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
     {
-      lock_acquire (&inode->lock);
+      lock_acquire (&open_inodes_lock);
       inode->open_cnt++;
-      lock_release (&inode->lock);
+      lock_release (&open_inodes_lock);
     }
   return inode;
 }
@@ -216,66 +408,240 @@ inode_is_dir (const struct inode *inode)
 void
 inode_close (struct inode *inode)
 {
-  size_t i, j;
-  struct inode_disk disk_inode;
-  struct pointer_block temp1, temp2;
+  bool last;
+
   /* Ignore null pointer. */
   if (inode == NULL)
     return;
 
-  lock_acquire(&inode->lock);
-
-  /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  /* A removed inode cannot be opened again, so it leaves the
+     table at once, before its sector can be reused. */
+  lock_acquire (&open_inodes_lock);
+  last = --inode->open_cnt == 0;
+  if (last && inode->removed)
+    hash_delete (&open_inodes, &inode->elem);
+  lock_release (&open_inodes_lock);
+
+  /* Release resources if this was the last opener.  Otherwise
+     INODE stays in the table until it is written back, so that a
+     new opener waits for it instead of reading the old copy from
+     disk. */
+  if (last)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
+      rw_lock_acquire_write (&inode->lock);
 
       /* Deallocate blocks if removed. */
-      if (inode->removed)
-        {
-          block_read(fs_device, inode->sector, &disk_inode);
-          for (i = 0; i < 124; i++)
-            {
-              if (disk_inode.direct[i] != 0)
-                free_map_release(disk_inode.direct[i], 1);
-            }
-
-          if (disk_inode.single_indirect != 0) {
-            block_read(fs_device, disk_inode.single_indirect, &temp1);
-            for (i = 0; i < 128; i++)
-              {
-                if (temp1.pointer[i] != 0)
-                  free_map_release(temp1.pointer[i], 1);
-              }
-            free_map_release(disk_inode.single_indirect, 1);
-          }
+      if (inode->removed && is_inline (inode))
+        free_map_release (inode->sector, 1);
+      else if (inode->removed)
+        release_blocks (inode);
+      else
+        inode_flush (inode);
 
-          if (disk_inode.double_indirect != 0) {
-            block_read(fs_device, disk_inode.double_indirect, &temp1);
-            for (i = 0; i < 128; i++)
-              {
-                if (temp1.pointer[i] != 0) {
-                  block_read(fs_device, temp1.pointer[i], &temp2);
-                  for (j = 0; j < 128; j++)
-                    {
-                      if (temp2.pointer[j] != 0)
-                        free_map_release(temp2.pointer[j], 1);
-                    }
-                  free_map_release(temp1.pointer[i], 1);
-                }
-              }
-            free_map_release(disk_inode.double_indirect, 1);
-          }
+      rw_lock_release_write (&inode->lock);
 
-          free_map_release(inode->sector, 1);
+      if (!inode->removed)
+        {
+          lock_acquire (&open_inodes_lock);
+          hash_delete (&open_inodes, &inode->elem);
+          cond_broadcast (&inode_closed, &open_inodes_lock);
+          lock_release (&open_inodes_lock);
         }
-
-      lock_release(&inode->lock);
       free (inode);
     }
-  else
-    lock_release(&inode->lock);
+}
+
+/* Sectors collected for one free_map_release_sectors() call. */
+struct sector_batch
+  {
+    block_sector_t *sectors;            /* Collected sectors. */
+    size_t cnt;                         /* Number collected. */
+    size_t cap;                         /* Capacity of SECTORS. */
+    block_sector_t fallback[128];       /* SECTORS if malloc() fails. */
+  };
+
+/* Initializes BATCH to hold up to CAP sectors, falling back to
+   releasing a pointer block's worth at a time if memory is
+   short. */
+static void
+batch_init (struct sector_batch *batch, size_t cap)
+{
+  batch->cnt = 0;
+  batch->cap = cap;
+  batch->sectors = malloc (cap * sizeof *batch->sectors);
+  if (batch->sectors == NULL)
+    {
+      batch->sectors = batch->fallback;
+      batch->cap = sizeof batch->fallback / sizeof *batch->fallback;
+    }
+}
+
+/* Releases the sectors left in BATCH and frees its memory. */
+static void
+batch_finish (struct sector_batch *batch)
+{
+  free_map_release_sectors (batch->sectors, batch->cnt);
+  if (batch->sectors != batch->fallback)
+    free (batch->sectors);
+}
+
+/* Adds SECTOR, unless it is 0, to BATCH, first releasing what
+   BATCH holds if it is full. */
+static void
+batch_add (struct sector_batch *batch, block_sector_t sector)
+{
+  if (sector == 0)
+    return;
+  if (batch->cnt == batch->cap)
+    {
+      free_map_release_sectors (batch->sectors, batch->cnt);
+      batch->cnt = 0;
+    }
+  batch->sectors[batch->cnt++] = sector;
+}
+
+/* Frees INODE's sector and every data and pointer block it uses,
+   all in one update of the free map.
+   Assumes thread_current holds INODE's lock to write. */
+static void
+release_blocks (struct inode *inode)
+{
+  struct sector_batch batch;
+
+  batch_init (&batch, calculate_additional_sectors (0, inode->data.size) + 1);
+  truncate_blocks (inode, 0, &batch);
+  batch_add (&batch, inode->sector);
+  batch_finish (&batch);
+}
+
+/* Sets INODE's length to LENGTH bytes.  Shrinking it frees the
+   data blocks past the new end, and the pointer blocks left with
+   nothing to point to, in one update of the free map; growing it
+   leaves a hole.
+   Returns false if LENGTH is out of range, INODE is a directory,
+   or writes to INODE are denied. */
+bool
+inode_resize (struct inode *inode, off_t length)
+{
+  bool success;
+
+  rw_lock_acquire_write (&inode->lock);
+  success = (length >= 0 && (size_t) length <= MAX_FILE_SIZE
+             && !inode->is_dir && !inode->deny_write_cnt);
+  if (success && is_inline (inode))
+    {
+      if (length > INLINE_MAX)
+        success = promote_inline (inode);
+      else if ((uint32_t) length < inode->data.size)
+        memset (inode->data.inline_data + length, 0,
+                inode->data.size - length);
+    }
+  else if (success && (uint32_t) length < inode->data.size)
+    {
+      struct sector_batch batch;
+      int sector_ofs = length % BLOCK_SECTOR_SIZE;
+      block_sector_t sector;
+
+      batch_init (&batch, calculate_additional_sectors (0, inode->data.size));
+      truncate_blocks (inode, bytes_to_sectors (length), &batch);
+      batch_finish (&batch);
+
+      /* Zero the rest of the last sector kept, so that it reads as
+         zeros if the file grows again. */
+      sector = lookup_sector (inode, length);
+      if (sector_ofs != 0 && sector != 0)
+        dcache_write_at_offset (fs_device, sector, zeros, sector_ofs,
+                                BLOCK_SECTOR_SIZE - sector_ofs, false);
+    }
+  if (success)
+    {
+      inode->data.size = length;
+      inode->dirty = true;
+    }
+  rw_lock_release_write (&inode->lock);
+  return success;
+}
+
+/* Adds the sector in *SLOT, if any, to BATCH and clears *SLOT.
+   Returns true if *SLOT changed. */
+static bool
+drop_pointer (struct sector_batch *batch, block_sector_t *slot)
+{
+  if (*slot == 0)
+    return false;
+  batch_add (batch, *slot);
+  *slot = 0;
+  return true;
+}
+
+/* Adds the pointer block in *SLOT, which is at LEVEL of INODE's
+   translation cache, to BATCH and clears *SLOT, which belongs to
+   the block at LEVEL - 1.  DIRTY is as for load_map().
+   Assumes thread_current holds INODE's lock to write. */
+static void
+drop_map (struct inode *inode, int level, block_sector_t *slot,
+          struct sector_batch *batch, bool dirty[2])
+{
+  drop_pointer (batch, slot);
+  inode->map_sector[level] = 0;
+  dirty[level] = false;
+  if (level > 0)
+    dirty[level - 1] = true;
+}
+
+/* Adds every data sector of INODE from sector KEEP on to BATCH,
+   along with the pointer blocks that then point to nothing, and
+   clears the pointers to them.
+   Assumes thread_current holds INODE's lock to write. */
+static void
+truncate_blocks (struct inode *inode, size_t keep,
+                 struct sector_batch *batch)
+{
+  struct inode_disk *disk_inode = &inode->data;
+  struct pointer_block *block;
+  bool dirty[2] = {false, false};
+  size_t start, i, j;
+
+  for (i = keep; i < DIRECT_POINTERS; i++)
+    drop_pointer (batch, &disk_inode->direct[i]);
+
+  start = keep > DIRECT_POINTERS ? keep - DIRECT_POINTERS : 0;
+  if (disk_inode->single_indirect != 0 && start < SECTORS_PER_BLOCK)
+    {
+      block = load_map (inode, 0, &disk_inode->single_indirect,
+                        NULL, NULL, dirty);
+      for (i = start; i < SECTORS_PER_BLOCK; i++)
+        dirty[0] |= drop_pointer (batch, &block->pointer[i]);
+      if (start == 0)
+        drop_map (inode, 0, &disk_inode->single_indirect, batch, dirty);
+    }
+
+  start = (keep > DIRECT_POINTERS + SECTORS_PER_BLOCK
+           ? keep - DIRECT_POINTERS - SECTORS_PER_BLOCK : 0);
+  if (disk_inode->double_indirect != 0)
+    {
+      block = load_map (inode, 0, &disk_inode->double_indirect,
+                        NULL, NULL, dirty);
+      for (i = start / SECTORS_PER_BLOCK; i < SECTORS_PER_BLOCK; i++)
+        if (block->pointer[i] != 0)
+          {
+            size_t first = (i == start / SECTORS_PER_BLOCK
+                            ? start % SECTORS_PER_BLOCK : 0);
+            struct pointer_block *inner;
+
+            inner = load_map (inode, 1, &block->pointer[i],
+                              NULL, NULL, dirty);
+            for (j = first; j < SECTORS_PER_BLOCK; j++)
+              dirty[1] |= drop_pointer (batch, &inner->pointer[j]);
+            if (first == 0)
+              drop_map (inode, 1, &block->pointer[i], batch, dirty);
+          }
+      if (start == 0)
+        drop_map (inode, 0, &disk_inode->double_indirect, batch, dirty);
+    }
+
+  flush_map (inode, 0, dirty);
+  flush_map (inode, 1, dirty);
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -284,9 +650,9 @@ void
 inode_remove (struct inode *inode)
 {
   ASSERT (inode != NULL);
-  lock_acquire(&inode->lock);
+  rw_lock_acquire_write (&inode->lock);
   inode->removed = true;
-  lock_release(&inode->lock);
+  rw_lock_release_write (&inode->lock);
 }
 
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
@@ -297,17 +663,29 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 {
   uint8_t *buffer = buffer_;
   off_t bytes_read = 0;
-  struct inode_disk disk_inode;
+  off_t start = offset;
+  off_t length;
 
-  lock_acquire(&inode->lock);
+  rw_lock_acquire_read (&inode->lock);
 
   if (inode->removed && inode->is_dir) {
-    lock_release(&inode->lock);
+    rw_lock_release_read (&inode->lock);
     return 0;
   }
 
-  /* Load inode contents into memory. */
-  block_read(fs_device, inode->sector, &disk_inode);
+  length = inode->data.size;
+
+  /* Inline data is already in memory. */
+  if (is_inline (inode))
+    {
+      if (offset < length)
+        {
+          bytes_read = size < length - offset ? size : length - offset;
+          memcpy (buffer, inode->data.inline_data + offset, bytes_read);
+        }
+      rw_lock_release_read (&inode->lock);
+      return bytes_read;
+    }
 
   while (size > 0)
     {
@@ -316,7 +694,7 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = disk_inode.size - offset;
+      off_t inode_left = length - offset;
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
       int min_left = inode_left < sector_left ? inode_left : sector_left;
 
@@ -325,7 +703,12 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
+      if (sector_idx == 0)
+        {
+          /* Holes read as zeros. */
+          memset (buffer + bytes_read, 0, chunk_size);
+        }
+      else if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
         {
           /* Read full sector directly into caller's buffer. */
           dcache_read (fs_device, sector_idx, buffer + bytes_read);
@@ -342,57 +725,107 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       bytes_read += chunk_size;
     }
 
-  lock_release (&inode->lock);
+  inode_read_ahead (inode, start, bytes_read, length);
+  rw_lock_release_read (&inode->lock);
   return bytes_read;
 }
 
-void
-zero_out_inode_disk (struct inode* inode, struct inode_disk* disk_inode, off_t size, off_t offset)
+/* Pins the sector holding byte OFFSET of INODE and returns a
+   pointer to that byte, so that it can be read in place.  Sets
+   *CNT to the number of bytes from there to the end of the
+   sector or of INODE, whichever comes first, and *PIN to the
+   handle to pass to dcache_unpin().  Returns a null pointer,
+   pinning nothing, if OFFSET is at or past the end of INODE.  In
+   a hole, points into a sector of zeros and sets *PIN to a null
+   pointer, which dcache_unpin() ignores. */
+const void *
+inode_pin_at (struct inode *inode, off_t offset, off_t *cnt,
+              struct cache_block **pin)
 {
-  ASSERT (disk_inode != NULL);
-
-  uint8_t zeros[BLOCK_SECTOR_SIZE];
-  memset (zeros, 0, BLOCK_SECTOR_SIZE);
-  off_t bytes_written = 0;
+  const uint8_t *data = NULL;
+  off_t length;
 
-  while (size > 0)
+  rw_lock_acquire_read (&inode->lock);
+  length = inode->data.size;
+  if (offset < length && !(inode->removed && inode->is_dir))
     {
-      /* Sector to write, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
-
-      /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = disk_inode->size - offset;
+      off_t inode_left = length - offset;
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
-      int min_left = inode_left < sector_left ? inode_left : sector_left;
 
-      /* Number of bytes to actually write into this sector. */
-      int chunk_size = size < min_left ? size : min_left;
-      if (chunk_size <= 0)
-        break;
+      block_sector_t sector = byte_to_sector (inode, offset);
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
-        {
-          /* Write full sector directly to disk. */
-          dcache_write (fs_device, sector_idx, zeros);
-        }
+      *cnt = inode_left < sector_left ? inode_left : sector_left;
+      if (sector != 0)
+        data = dcache_pin (fs_device, sector, pin);
       else
         {
-          dcache_write_at_offset (fs_device, sector_idx,
-                                  zeros,
-                                  sector_ofs, chunk_size,
-                                  !((sector_ofs > 0) ||
-                                    (chunk_size < sector_left)));
+          data = zeros;
+          *pin = NULL;
         }
+      data += sector_ofs;
+    }
+  rw_lock_release_read (&inode->lock);
+  return data;
+}
 
-      /* Advance. */
-      size -= chunk_size;
-      offset += chunk_size;
-      bytes_written += chunk_size;
+/* Tracks whether reads of INODE are sequential, given that SIZE
+   bytes were just read at OFFSET of a file LENGTH bytes long.
+   While they are, queues the next ra_window sectors for the
+   prefetcher, doubling the window each time; a read anywhere
+   else turns read-ahead off until the reader is sequential
+   again.
+   Assumes thread_current holds INODE's lock. */
+static void
+inode_read_ahead (struct inode *inode, off_t offset, off_t size, off_t length)
+{
+  off_t ofs, end;
+
+  lock_acquire (&inode->map_lock);
+  if (offset == inode->ra_next && size > 0)
+    {
+      if (inode->ra_window == 0)
+        inode->ra_window = READ_AHEAD_MIN;
+      else if (inode->ra_window < READ_AHEAD_MAX)
+        inode->ra_window *= 2;
+    }
+  else
+    {
+      inode->ra_window = 0;
+      inode->ra_end = 0;
+    }
+  inode->ra_next = offset + size;
+  if (inode->ra_window == 0)
+    {
+      lock_release (&inode->map_lock);
+      return;
+    }
+
+  /* Queue whole sectors past what the reader has and what is
+     already queued. */
+  ofs = ROUND_UP (inode->ra_next, BLOCK_SECTOR_SIZE);
+  if (ofs < inode->ra_end)
+    ofs = inode->ra_end;
+  end = inode->ra_next + (off_t) inode->ra_window * BLOCK_SECTOR_SIZE;
+  if (end > length)
+    end = length;
+  if (end > inode->ra_end)
+    inode->ra_end = ROUND_UP (end, BLOCK_SECTOR_SIZE);
+  lock_release (&inode->map_lock);
+
+  for (; ofs < end; ofs += BLOCK_SECTOR_SIZE)
+    {
+      block_sector_t sector = byte_to_sector (inode, ofs);
+      if (sector != 0)
+        dcache_prefetch (fs_device, sector);
     }
 }
 
-/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
+/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET,
+   first allocating sectors for any holes in that range.  A write
+   past the end extends INODE, leaving a hole between the old end
+   and OFFSET.  A write that needs neither shares INODE's lock
+   with readers and other such writers.
    Returns the number of bytes actually written, which may be
    less than SIZE if end of file is reached or an error occurs. */
 off_t
@@ -401,51 +834,60 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
-  struct inode_disk disk_inode;
-
-  lock_acquire(&inode->lock);
+  bool shared;
 
-  if (inode->deny_write_cnt) {
-    lock_release (&inode->lock);
-    return 0;
-  }
-  if (inode->removed && inode->is_dir) {
-    lock_release (&inode->lock);
-    return 0;
-  }
+  rw_lock_acquire_read (&inode->lock);
+  shared = fits_in_place (inode, size, offset);
+  if (!shared)
+    {
+      rw_lock_release_read (&inode->lock);
+      rw_lock_acquire_write (&inode->lock);
+    }
 
-  /* Load inode contents into memory. */
-  block_read (fs_device, inode->sector, &disk_inode);
+  if (inode->deny_write_cnt || (inode->removed && inode->is_dir))
+    {
+      release_lock (inode, shared);
+      return 0;
+    }
 
-  /* Resize the file if necessary. */
-  if ((uint32_t) (offset + size) > disk_inode.size)
+  /* Write inline data in place, writing the inode back to the
+     cache as a data sector would be, unless the file outgrows
+     it. */
+  if (is_inline (inode) && offset + size <= INLINE_MAX)
     {
-      size_t old_sz = disk_inode.size;
-      if (!inode_resize (&disk_inode, offset + size, inode->sector))
+      if (size > 0)
         {
-          lock_release (&inode->lock);
-          return 0;
+          memcpy (inode->data.inline_data + offset, buffer, size);
+          if ((uint32_t) (offset + size) > inode->data.size)
+            inode->data.size = offset + size;
+          inode->dirty = true;
+          inode_flush (inode);
         }
-      block_read (fs_device, inode->sector, &disk_inode);
-      zero_out_inode_disk (inode, &disk_inode, disk_inode.size - old_sz, old_sz);
+      release_lock (inode, shared);
+      return size;
     }
 
+  /* Allocate sectors for the part being written. */
+  if (!shared && size > 0
+      && ((size_t) (offset + size) > MAX_FILE_SIZE
+          || (is_inline (inode) && !promote_inline (inode))
+          || !allocate_range (inode, offset, offset + size)))
+    {
+      release_lock (inode, shared);
+      return 0;
+    }
 
   while (size > 0)
     {
       /* Sector to write, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      block_sector_t sector_idx = lookup_sector (inode, offset);
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
-      /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = disk_inode.size - offset;
+      /* Bytes left in sector. */
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
-      int min_left = inode_left < sector_left ? inode_left : sector_left;
 
       /* Number of bytes to actually write into this sector. */
-      int chunk_size = size < min_left ? size : min_left;
-      if (chunk_size <= 0)
-        break;
+      int chunk_size = size < sector_left ? size : sector_left;
 
       if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
         {
@@ -467,19 +909,257 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
       bytes_written += chunk_size;
     }
 
-  lock_release (&inode->lock);
+  if ((uint32_t) offset > inode->data.size)
+    {
+      inode->data.size = offset;
+      inode->dirty = true;
+    }
+  release_lock (inode, shared);
   return bytes_written;
 }
 
+/* Returns true if writing SIZE bytes at OFFSET in INODE would
+   only overwrite sectors INODE already has, so that the write
+   needs INODE's lock only to read.
+   Assumes thread_current holds INODE's lock. */
+static bool
+fits_in_place (struct inode *inode, off_t size, off_t offset)
+{
+  if (size <= 0)
+    return true;
+  if (is_inline (inode) || (uint32_t) (offset + size) > inode->data.size)
+    return false;
+  return count_holes (inode, offset / BLOCK_SECTOR_SIZE,
+                      (offset + size - 1) / BLOCK_SECTOR_SIZE) == 0;
+}
+
+/* Releases INODE's lock, which thread_current holds to read if
+   SHARED, to write otherwise. */
+static void
+release_lock (struct inode *inode, bool shared)
+{
+  if (shared)
+    rw_lock_release_read (&inode->lock);
+  else
+    rw_lock_release_write (&inode->lock);
+}
+
+/* Moves INODE's inline data into a data block of its own, so
+   that it can grow past INLINE_MAX bytes.
+   Returns false if memory or disk allocation fails, leaving
+   INODE inline.
+   Assumes thread_current holds INODE's lock to write. */
+static bool
+promote_inline (struct inode *inode)
+{
+  struct inode_disk *disk_inode = &inode->data;
+  off_t length = disk_inode->size;
+  uint8_t *copy;
+
+  ASSERT (is_inline (inode));
+  copy = malloc (INLINE_MAX);
+  if (copy == NULL)
+    return false;
+  memcpy (copy, disk_inode->inline_data, INLINE_MAX);
+
+  memset (disk_inode->inline_data, 0, INLINE_MAX);
+  disk_inode->flags &= ~INODE_INLINE;
+  forget_map (inode);
+  if (length > 0)
+    {
+      if (!allocate_range (inode, 0, length))
+        {
+          memcpy (disk_inode->inline_data, copy, INLINE_MAX);
+          disk_inode->flags |= INODE_INLINE;
+          free (copy);
+          return false;
+        }
+      dcache_write_at_offset (fs_device, disk_inode->direct[0], copy, 0,
+                              length, false);
+    }
+  inode->dirty = true;
+  free (copy);
+  return true;
+}
+
+/* Allocates sectors for every hole in bytes START through END - 1
+   of INODE, including any pointer blocks they need, as a single
+   free map request.  The new sectors go right after the sector
+   before START, if that one is allocated, so that a file written
+   in order stays contiguous.  Newly allocated sectors that the
+   write will only partly cover are zeroed.
+   Returns false if there is not enough free space.
+   Assumes thread_current holds INODE's lock to write. */
+static bool
+allocate_range (struct inode *inode, off_t start, off_t end)
+{
+  struct inode_disk *disk_inode = &inode->data;
+  size_t first = start / BLOCK_SECTOR_SIZE;
+  size_t last = (end - 1) / BLOCK_SECTOR_SIZE;
+  size_t cnt, next, idx;
+  block_sector_t *sectors;
+  block_sector_t goal;
+  bool dirty[2] = {false, false};
+
+  cnt = count_holes (inode, first, last);
+  if (cnt == 0)
+    return true;
+
+  goal = first > 0 ? lookup_sector (inode, (first - 1) * BLOCK_SECTOR_SIZE)
+                   : 0;
+  goal = goal != 0 ? goal + 1 : inode->sector + 1;
+  sectors = malloc (cnt * sizeof *sectors);
+  if (sectors == NULL || !free_map_request (cnt, goal, sectors))
+    {
+      free (sectors);
+      return false;
+    }
+
+  next = 0;
+  for (idx = first; idx <= last; idx++)
+    {
+      struct pointer_block *block;
+      block_sector_t *slot;
+      int level;
+
+      if (idx < DIRECT_POINTERS)
+        {
+          slot = &disk_inode->direct[idx];
+          level = -1;
+        }
+      else if (idx < DIRECT_POINTERS + SECTORS_PER_BLOCK)
+        {
+          block = load_map (inode, 0, &disk_inode->single_indirect,
+                            sectors, &next, dirty);
+          slot = &block->pointer[idx - DIRECT_POINTERS];
+          level = 0;
+        }
+      else
+        {
+          size_t i = idx - DIRECT_POINTERS - SECTORS_PER_BLOCK;
+          block = load_map (inode, 0, &disk_inode->double_indirect,
+                            sectors, &next, dirty);
+          block = load_map (inode, 1, &block->pointer[i / SECTORS_PER_BLOCK],
+                            sectors, &next, dirty);
+          slot = &block->pointer[i % SECTORS_PER_BLOCK];
+          level = 1;
+        }
+
+      if (*slot == 0)
+        {
+          *slot = sectors[next++];
+          if (level >= 0)
+            dirty[level] = true;
+          if ((idx == first && start % BLOCK_SECTOR_SIZE != 0)
+              || (idx == last && end % BLOCK_SECTOR_SIZE != 0))
+            dcache_write (fs_device, *slot, zeros);
+        }
+    }
+  flush_map (inode, 0, dirty);
+  flush_map (inode, 1, dirty);
+  inode->dirty = true;
+
+  ASSERT (next == cnt);
+  free (sectors);
+  return true;
+}
+
+/* Returns the number of sectors, counting pointer blocks, that
+   allocate_range() needs to fill the holes in sectors FIRST
+   through LAST of INODE.
+   Assumes thread_current holds INODE's lock. */
+static size_t
+count_holes (struct inode *inode, size_t first, size_t last)
+{
+  const struct inode_disk *disk_inode = &inode->data;
+  size_t cnt = 0;
+  size_t idx;
+
+  for (idx = first; idx <= last; idx++)
+    {
+      block_sector_t sector;
+
+      if (idx < DIRECT_POINTERS)
+        sector = disk_inode->direct[idx];
+      else if (idx < DIRECT_POINTERS + SECTORS_PER_BLOCK)
+        {
+          if (disk_inode->single_indirect == 0
+              && (idx == first || idx == DIRECT_POINTERS))
+            cnt++;
+          sector = read_pointer (inode, 0, disk_inode->single_indirect,
+                                 idx - DIRECT_POINTERS);
+        }
+      else
+        {
+          size_t i = idx - DIRECT_POINTERS - SECTORS_PER_BLOCK;
+          block_sector_t inner;
+
+          if (disk_inode->double_indirect == 0 && (idx == first || i == 0))
+            cnt++;
+          inner = read_pointer (inode, 0, disk_inode->double_indirect,
+                                i / SECTORS_PER_BLOCK);
+          if (inner == 0 && (idx == first || i % SECTORS_PER_BLOCK == 0))
+            cnt++;
+          sector = read_pointer (inode, 1, inner, i % SECTORS_PER_BLOCK);
+        }
+      if (sector == 0)
+        cnt++;
+    }
+  return cnt;
+}
+
+/* Makes the pointer block that *SLOT points to the one at LEVEL
+   of INODE's translation cache and returns it.  If *SLOT is 0,
+   takes the next of SECTORS, as counted by *NEXT, for a new,
+   empty pointer block and stores it in *SLOT, which belongs to
+   the block at LEVEL - 1.  DIRTY records which levels of the
+   cache have changes not yet written back.
+   Assumes thread_current holds INODE's lock to write. */
+static struct pointer_block *
+load_map (struct inode *inode, int level, block_sector_t *slot,
+          const block_sector_t *sectors, size_t *next, bool dirty[2])
+{
+  if (*slot == 0)
+    {
+      flush_map (inode, level, dirty);
+      *slot = sectors[(*next)++];
+      if (level > 0)
+        dirty[level - 1] = true;
+      memset (&inode->map[level], 0, sizeof inode->map[level]);
+      inode->map_sector[level] = *slot;
+      dirty[level] = true;
+    }
+  else if (inode->map_sector[level] != *slot)
+    {
+      flush_map (inode, level, dirty);
+      block_read (fs_device, *slot, &inode->map[level]);
+      inode->map_sector[level] = *slot;
+    }
+  return &inode->map[level];
+}
+
+/* Writes back the pointer block at LEVEL of INODE's translation
+   cache if DIRTY says it has changed.
+   Assumes thread_current holds INODE's lock to write. */
+static void
+flush_map (struct inode *inode, int level, bool dirty[2])
+{
+  if (dirty[level])
+    {
+      block_write (fs_device, inode->map_sector[level], &inode->map[level]);
+      dirty[level] = false;
+    }
+}
+
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
 void
 inode_deny_write (struct inode *inode)
 {
-  lock_acquire(&inode->lock);
+  rw_lock_acquire_write (&inode->lock);
   inode->deny_write_cnt++;
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
-  lock_release(&inode->lock);
+  rw_lock_release_write (&inode->lock);
 }
 
 /* Re-enables writes to INODE.
@@ -488,11 +1168,11 @@ inode_deny_write (struct inode *inode)
 void
 inode_allow_write (struct inode *inode)
 {
-  lock_acquire (&inode->lock);
+  rw_lock_acquire_write (&inode->lock);
   ASSERT (inode->deny_write_cnt > 0);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
   inode->deny_write_cnt--;
-  lock_release (&inode->lock);
+  rw_lock_release_write (&inode->lock);
 }
 
 /* Returns the length, in bytes, of INODE's data. */
@@ -500,50 +1180,51 @@ off_t
 inode_length (struct inode *inode)
 {
   ASSERT (inode != NULL);
-  lock_acquire (&inode->lock);
-  size_t size = -1;
-  struct inode_disk* id;
-  uint8_t buff[BLOCK_SECTOR_SIZE];
-  block_read (fs_device, inode->sector, buff);
-  id = (struct inode_disk*) buff;
-  size = id->size;
-  lock_release (&inode->lock);
+  rw_lock_acquire_read (&inode->lock);
+  size_t size = inode->data.size;
+  rw_lock_release_read (&inode->lock);
   return size;
 }
 
-bool
-inode_resize (struct inode_disk *id, size_t new_size, block_sector_t sector)
+/* Writes back every open inode that has changed, so that flushing
+   the buffer cache afterward puts them on disk.  The table lock is
+   only held to open the dirty inodes, so that opening and closing
+   files does not wait for their locks or their writes. */
+void
+inode_flush_all (void)
 {
-  ASSERT (id != NULL);
-  if (id->size > new_size)
-    PANIC ("CANNOT DOWN-SIZE INODE_DISK");
-  else if (id->size == new_size)
+  struct hash_iterator i;
+  struct list dirty;
+
+  lock_acquire (&flush_all_lock);
+  list_init (&dirty);
+  lock_acquire (&open_inodes_lock);
+  hash_first (&i, &open_inodes);
+  while (hash_next (&i))
     {
-      block_write (fs_device, sector, id);
-      return true;
+      struct inode *inode = hash_entry (hash_cur (&i), struct inode, elem);
+
+      /* Leave inodes being closed to their last closer, and
+         removed ones to nobody.  A clean inode is skipped without
+         waiting for its lock; if it is being changed, a later
+         call will catch it. */
+      if (inode->open_cnt == 0 || inode->removed || !inode->dirty)
+        continue;
+      inode->open_cnt++;
+      list_push_back (&dirty, &inode->flush_elem);
     }
-  else if (new_size > MAX_FILE_SIZE)
-    return false;
+  lock_release (&open_inodes_lock);
 
-  size_t additional_sectors = calculate_additional_sectors (id->size, new_size);
-  if (additional_sectors == 0)
-    {
-      id->size = new_size;
-      block_write (fs_device, sector, id);
-      return true;
-    }
-  void* buffer = malloc (additional_sectors * sizeof (block_sector_t));
-  bool success = (buffer != NULL);
-  if (success)
+  while (!list_empty (&dirty))
     {
-      success = inode_disk_resize (id, new_size, buffer, additional_sectors);
-      if (success)
-        {
-          block_write (fs_device, sector, id);
-        }
-      free (buffer);
+      struct inode *inode = list_entry (list_pop_front (&dirty),
+                                        struct inode, flush_elem);
+      rw_lock_acquire_write (&inode->lock);
+      inode_flush (inode);
+      rw_lock_release_write (&inode->lock);
+      inode_close (inode);
     }
-  return success;
+  lock_release (&flush_all_lock);
 }
 
 size_t
@@ -574,114 +1255,3 @@ calculate_additional_sectors (size_t curr_size, size_t new_size)
   additional_meta_sectors = (new_meta_sectors - curr_meta_sectors);
   return (additional_data_sectors + additional_meta_sectors);
 }
-
-bool
-inode_disk_resize (struct inode_disk* id, size_t size,
-                    void* buff_, size_t total_sectors)
-{
-  block_sector_t buffer[128];
-  if (!free_map_request (total_sectors, buff_))
-    return false;
-
-  block_sector_t* get_sector = (block_sector_t*) buff_;
-  size_t sector_index = 0;
-  size_t i, j;
-
-  for (i = 0; i < DIRECT_POINTERS; i++)
-    {
-      if (size > BLOCK_SECTOR_SIZE * i && id->direct[i] == 0)
-        {
-          if (sector_index >= total_sectors)
-            PANIC ("WRONG MATH");
-          id->direct[i] = get_sector[sector_index++];
-        }
-    }
-  if (id->single_indirect == 0 && size <= DIRECT_POINTERS * BLOCK_SECTOR_SIZE)
-    {
-      ASSERT (sector_index == total_sectors);
-      id->size = size;
-      return true;
-    }
-
-  if (id->single_indirect == 0)
-    {
-      memset(buffer, 0, BLOCK_SECTOR_SIZE);
-      if (sector_index >= total_sectors) {
-        PANIC ("WRONG MATH");
-        return false;
-      }
-      id->single_indirect= get_sector[sector_index++];
-    }
-  else
-    block_read (fs_device, id->single_indirect, buffer);
-
-  for (i = 0; i < SECTORS_PER_BLOCK; i++)
-    {
-      if (size > (DIRECT_POINTERS + i) * BLOCK_SECTOR_SIZE && buffer[i] == 0)
-        {
-          if (sector_index >= total_sectors)
-            PANIC ("WRONG MATH");
-          buffer[i] = get_sector[sector_index++];
-        }
-    }
-  block_write (fs_device, id->single_indirect, buffer);
-  if (id->double_indirect == 0 &&
-      size <= (DIRECT_POINTERS + SECTORS_PER_BLOCK) * BLOCK_SECTOR_SIZE)
-    {
-      ASSERT (sector_index == total_sectors);
-      id->size = size;
-      return true;
-    }
-
-  if (id->double_indirect == 0)
-    {
-      memset (buffer, 0, BLOCK_SECTOR_SIZE);
-      if (sector_index >= total_sectors)
-        PANIC ("WRONG MATH");
-      id->double_indirect = get_sector[sector_index++];
-    }
-  else
-    block_read (fs_device, id->double_indirect, buffer);
-
-  block_sector_t buffer_helper[SECTORS_PER_BLOCK];
-
-  for (i = 0; i < SECTORS_PER_BLOCK ; ++i)
-    {
-      if (size <= (DIRECT_POINTERS + SECTORS_PER_BLOCK * (i + 1)) * BLOCK_SECTOR_SIZE)
-        break;
-
-      if (buffer[i] == 0)
-        {
-          if (sector_index >= total_sectors)
-            PANIC ("WRONG MATH");
-          buffer[i] = get_sector[sector_index++];
-          memset (buffer_helper, 0, BLOCK_SECTOR_SIZE);
-        }
-      else
-        {
-          block_read (fs_device, buffer[i], buffer_helper);
-        }
-
-      for (j = 0; j < SECTORS_PER_BLOCK; ++j)
-        {
-          if (size <= ((DIRECT_POINTERS + SECTORS_PER_BLOCK * (i + 1) + j) * BLOCK_SECTOR_SIZE)
-              && buffer_helper[j] != 0)
-            {
-              block_free (buffer_helper[j]);
-              buffer_helper[j] = 0;
-            }
-          if (size > ((DIRECT_POINTERS + SECTORS_PER_BLOCK * (i + 1) + j) * BLOCK_SECTOR_SIZE)
-              && buffer_helper[j] == 0)
-            {
-              if (sector_index >= total_sectors)
-                PANIC ("WRONG MATH");
-              buffer_helper[j] = get_sector[sector_index++];
-            }
-        }
-      block_write (fs_device, buffer[i], buffer_helper);
-    }
-  block_write (fs_device, id->double_indirect, buffer);
-  ASSERT (sector_index == total_sectors);
-  id->size = size;
-  return true;
-}
@@ -18,9 +18,13 @@ void inode_close (struct inode *);
 void inode_remove (struct inode *);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
+const void *inode_pin_at (struct inode *, off_t offset, off_t *cnt,
+                          struct cache_block **);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
 off_t inode_length (struct inode *);
+bool inode_resize (struct inode *, off_t length);
+void inode_flush_all (void);
 bool inode_is_dir (const struct inode *inode);
 
 #endif /* filesys/inode.h */
@@ -0,0 +1,60 @@
+#ifndef __LIB_BLOCK_STATS_H
+#define __LIB_BLOCK_STATS_H
+
+#include <stdint.h>
+
+/* Block layer and buffer cache statistics, as returned by the
+   get_block_stats() system call.  Everything counts from boot or
+   from the last reset_buffer(). */
+
+/* Devices reported, in registration order. */
+#define BLOCK_STATS_MAX_DEVICES 8
+
+/* Transfer latency histograms.  Bucket I counts transfers that
+   took 2**(BLOCK_STATS_LATENCY_SHIFT + I) to just under twice as
+   many TSC cycles, except that the first and last buckets also
+   count everything faster or slower. */
+#define BLOCK_STATS_LATENCY_BUCKETS 16
+#define BLOCK_STATS_LATENCY_SHIFT 10
+
+/* Buffer cache counters, summed over all shards. */
+struct cache_stats
+  {
+    uint64_t hits;              /* Lookups that found the sector. */
+    uint64_t misses;            /* Lookups that did not. */
+    uint64_t evictions;         /* Sectors dropped to make room. */
+    uint64_t writebacks;        /* Dirty sectors written back. */
+    uint64_t readaheads;        /* Sectors loaded by read-ahead. */
+    uint64_t readahead_hits;    /* Of those, sectors later hit. */
+    uint64_t lock_waits;        /* Times a cache lock was contended. */
+  };
+
+/* Counters for one block device.  Only transfers that reach the
+   driver are counted, not reads and writes served by the cache. */
+struct device_stats
+  {
+    char name[16];              /* Device name, e.g. "hda1". */
+    uint64_t read_cnt;          /* Sectors read. */
+    uint64_t write_cnt;         /* Sectors written. */
+    uint64_t read_cmds;         /* Driver requests that read. */
+    uint64_t write_cmds;        /* Driver requests that wrote. */
+    uint64_t read_latency[BLOCK_STATS_LATENCY_BUCKETS];
+    uint64_t write_latency[BLOCK_STATS_LATENCY_BUCKETS];
+
+    /* I/O scheduler. */
+    uint64_t requests;          /* Requests submitted. */
+    uint64_t demand_requests;   /* Of those, in the demand class. */
+    uint64_t merges;            /* Requests merged into another's command. */
+    uint64_t expired;           /* Dispatched because of their deadline. */
+    uint64_t queue_depth_sum;   /* Queue depth seen by each new request. */
+    uint64_t max_queue_depth;   /* Deepest the queue has been. */
+  };
+
+struct block_stats
+  {
+    struct cache_stats cache;
+    uint32_t device_cnt;        /* Entries used in DEVICES. */
+    struct device_stats devices[BLOCK_STATS_MAX_DEVICES];
+  };
+
+#endif /* lib/block-stats.h */
@@ -358,60 +358,32 @@ bitmap_write (const struct bitmap *b, struct file *file)
   off_t size = byte_cnt (b->bit_cnt);
   return file_write_at (file, b->bits, size, 0) == size;
 }
-#endif /* FILESYS */
-
-/* Debugging. */
 
-/* Dumps the contents of B to the console as hexadecimal. */
-void
-bitmap_dump (const struct bitmap *b)
+/* Writes the part of B that holds bits START through START + CNT
+   - 1 to FILE, where bitmap_write() would put it.  Rounds out to
+   whole elements.  Return true if successful, false otherwise. */
+bool
+bitmap_write_range (const struct bitmap *b, struct file *file,
+                    size_t start, size_t cnt)
 {
-  hex_dump (0, b->bits, byte_cnt (b->bit_cnt), false);
-}
+  off_t ofs, size;
 
-/*
-   Sets CNT bits (which are first set to !VALUE) in bitmap to VALUE.
-   Searches between START and B->BIT_CNT and assumes there are at least CNT
-   bits set to !VALUE.
-   Stores the indices of changes bits in BUFFER and assumes that BUFFER has
-   enough space for CNT.
-   Locations of these bits are not necessarily contiguous.
-*/
-void
-bitmap_set_any (struct bitmap *b, size_t start, size_t cnt, bool value,
-                uint32_t* buffer)
-{
-  ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
+  if (cnt == 0)
+    return true;
 
-  size_t i;
-  size_t buf_index = 0;
-  for (i = start; i < b->bit_cnt && buf_index < cnt; i++)
-    {
-      if (bitmap_test (b, i) != value)
-        {
-          bitmap_set (b, i, value);
-          buffer[buf_index++] = (uint32_t) i;
-        }
-    }
-  ASSERT (buf_index == cnt);
+  ofs = elem_idx (start) * sizeof (elem_type);
+  size = byte_cnt (start + cnt) - ofs;
+  return file_write_at (file, (uint8_t *) b->bits + ofs, size, ofs) == size;
 }
+#endif /* FILESYS */
 
-size_t
-bitmap_count_all (struct bitmap* b, bool value)
-{
-  return bitmap_count (b, 0, b->bit_cnt, value);
-}
+/* Debugging. */
 
+/* Dumps the contents of B to the console as hexadecimal. */
 void
-bitmap_set_sectors (struct bitmap* b, uint32_t* sectors, size_t total_sectors, bool value)
+bitmap_dump (const struct bitmap *b)
 {
-  ASSERT (b != NULL);
-  ASSERT (sectors != NULL);
-  size_t i;
-  for (i = 0; i < total_sectors; ++i)
-    {
-      bitmap_set (b, sectors[i], value);
-    }
+  hex_dump (0, b->bits, byte_cnt (b->bit_cnt), false);
 }
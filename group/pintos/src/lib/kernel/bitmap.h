@@ -43,17 +43,10 @@ struct file;
 size_t bitmap_file_size (const struct bitmap *);
 bool bitmap_read (struct bitmap *, struct file *);
 bool bitmap_write (const struct bitmap *, struct file *);
+bool bitmap_write_range (const struct bitmap *, struct file *,
+                         size_t start, size_t cnt);
 #endif
 
-void
-bitmap_set_any (struct bitmap *b, size_t start, size_t cnt, bool value,
-                uint32_t* buffer);
-size_t
-bitmap_count_all (struct bitmap* b, bool value);
-
-void
-bitmap_set_sectors (struct bitmap* b, uint32_t* sectors, size_t total_sectors, bool value);
-
 /* Debugging. */
 void bitmap_dump (const struct bitmap *);
 
@@ -32,7 +32,9 @@ enum
     SYS_INUMBER,                /* Returns the inode number for a fd. */
 
     SYS_RESET_BUFFER,
-    SYS_GET_STATS
+    SYS_GET_STATS,
+    SYS_GET_BLOCK_STATS,        /* Copies out cache and disk stats. */
+    SYS_TRUNCATE                /* Changes the length of a file. */
   };
 
 #endif /* lib/syscall-nr.h */
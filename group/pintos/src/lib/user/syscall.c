@@ -196,3 +196,15 @@ void reset_buffer (void) {
 int get_stats (int i) {
   return syscall1 (SYS_GET_STATS, i);
 }
+
+void
+get_block_stats (struct block_stats *stats)
+{
+  syscall1 (SYS_GET_BLOCK_STATS, stats);
+}
+
+bool
+truncate (int fd, unsigned length)
+{
+  return syscall2 (SYS_TRUNCATE, fd, length);
+}
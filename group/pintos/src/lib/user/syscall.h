@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <debug.h>
+#include <block-stats.h>
 
 /* Process identifier. */
 typedef int pid_t;
@@ -48,5 +49,7 @@ int inumber (int fd);
 
 void reset_buffer (void);
 int get_stats (int index);
+void get_block_stats (struct block_stats *);
+bool truncate (int fd, unsigned length);
 
 #endif /* lib/user/syscall.h */
@@ -0,0 +1,85 @@
+/* Checks the block statistics returned by get_block_stats().
+   After reset_buffer() the cache counters start from zero.
+   Reading a file into the cold cache has to go to the disk, and
+   reading it again has to be served by the cache. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define BLOCK_SIZE 512
+#define BLOCK_CNT 8
+static char buf_a[BLOCK_SIZE];
+static struct block_stats cold, warm;
+
+/* Reads all of "a". */
+static void
+read_a (void)
+{
+  int fd_a;
+  int i;
+
+  CHECK ((fd_a = open ("a")) > 1, "open \"a\"");
+  msg ("read \"a\"");
+  for (i = 0; i < BLOCK_CNT; i++)
+    if (read (fd_a, buf_a, BLOCK_SIZE) != BLOCK_SIZE)
+      fail ("read of block %d in \"a\" failed", i);
+  msg ("close \"a\"");
+  close (fd_a);
+}
+
+/* Returns the number of sectors read from all devices. */
+static uint64_t
+disk_reads (const struct block_stats *stats)
+{
+  uint64_t sum = 0;
+  uint32_t i;
+
+  for (i = 0; i < stats->device_cnt; i++)
+    sum += stats->devices[i].read_cnt;
+  return sum;
+}
+
+void
+test_main (void)
+{
+  int fd_a;
+  int i;
+
+  random_init (0);
+  random_bytes (buf_a, sizeof buf_a);
+
+  CHECK (create ("a", 0), "create \"a\"");
+  CHECK ((fd_a = open ("a")) > 1, "open \"a\"");
+  for (i = 0; i < BLOCK_CNT; i++)
+    if (write (fd_a, buf_a, BLOCK_SIZE) != BLOCK_SIZE)
+      fail ("write of block %d in \"a\" failed", i);
+  msg ("close \"a\"");
+  close (fd_a);
+
+  msg ("reset buffer");
+  reset_buffer ();
+  get_block_stats (&cold);
+  if (cold.cache.hits != 0 || cold.cache.misses != 0)
+    fail ("cache counters not zero after reset");
+  if (cold.device_cnt == 0)
+    fail ("no devices reported");
+
+  read_a ();
+  get_block_stats (&cold);
+  if (disk_reads (&cold) == 0)
+    fail ("cold read did not read the disk");
+  if (cold.cache.hits + cold.cache.misses < BLOCK_CNT)
+    fail ("cold read made only %d cache lookups",
+          (int) (cold.cache.hits + cold.cache.misses));
+
+  read_a ();
+  get_block_stats (&warm);
+  if (warm.cache.hits - cold.cache.hits < BLOCK_CNT)
+    fail ("warm read hit only %d times",
+          (int) (warm.cache.hits - cold.cache.hits));
+  msg ("warm read served by the cache");
+
+  remove ("a");
+}
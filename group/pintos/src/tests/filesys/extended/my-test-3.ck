@@ -0,0 +1,20 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(my-test-3) begin
+(my-test-3) create "a"
+(my-test-3) open "a"
+(my-test-3) close "a"
+(my-test-3) reset buffer
+(my-test-3) open "a"
+(my-test-3) read "a"
+(my-test-3) close "a"
+(my-test-3) open "a"
+(my-test-3) read "a"
+(my-test-3) close "a"
+(my-test-3) warm read served by the cache
+(my-test-3) end
+EOF
+pass;
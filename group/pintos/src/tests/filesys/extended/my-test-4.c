@@ -0,0 +1,47 @@
+/* Checks truncate().  Writes a file that reaches into the
+   indirect block, shrinks it to part of its second sector, then
+   grows it again.  The bytes kept must be unchanged and the
+   regrown part must read as zeros, including the rest of the
+   sector that was cut in the middle. */
+
+#include <random.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE 80000
+#define SHORT_SIZE 1000
+#define REGROWN_SIZE 70000
+static char buf_a[FILE_SIZE];
+
+void
+test_main (void)
+{
+  int fd_a;
+
+  random_init (0);
+  random_bytes (buf_a, sizeof buf_a);
+
+  CHECK (create ("a", 0), "create \"a\"");
+  CHECK ((fd_a = open ("a")) > 1, "open \"a\"");
+  if (write (fd_a, buf_a, FILE_SIZE) != FILE_SIZE)
+    fail ("write of %d bytes in \"a\" failed", FILE_SIZE);
+
+  CHECK (truncate (fd_a, SHORT_SIZE), "truncate \"a\" to %d bytes",
+         SHORT_SIZE);
+  if (filesize (fd_a) != SHORT_SIZE)
+    fail ("filesize of \"a\" is %d after truncate", filesize (fd_a));
+
+  CHECK (truncate (fd_a, REGROWN_SIZE), "truncate \"a\" to %d bytes",
+         REGROWN_SIZE);
+  if (filesize (fd_a) != REGROWN_SIZE)
+    fail ("filesize of \"a\" is %d after truncate", filesize (fd_a));
+  msg ("close \"a\"");
+  close (fd_a);
+
+  memset (buf_a + SHORT_SIZE, 0, REGROWN_SIZE - SHORT_SIZE);
+  check_file ("a", buf_a, REGROWN_SIZE);
+
+  remove ("a");
+}
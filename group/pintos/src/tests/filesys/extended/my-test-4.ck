@@ -0,0 +1,17 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(my-test-4) begin
+(my-test-4) create "a"
+(my-test-4) open "a"
+(my-test-4) truncate "a" to 1000 bytes
+(my-test-4) truncate "a" to 70000 bytes
+(my-test-4) close "a"
+(my-test-4) open "a" for verification
+(my-test-4) verified contents of "a"
+(my-test-4) close "a"
+(my-test-4) end
+EOF
+pass;
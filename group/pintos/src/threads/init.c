@@ -244,6 +244,17 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-cache"))
+        cache_configure (atoi (value));
+      else if (!strcmp (name, "-cache-policy"))
+        {
+          if (!cache_set_policy (value))
+            PANIC ("unknown cache policy `%s' (use -h for help)", value);
+        }
+      else if (!strcmp (name, "-cache-flush"))
+        cache_set_flush_interval (atoi (value));
+      else if (!strcmp (name, "-cache-dirty"))
+        cache_set_dirty_limit (atoi (value));
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -370,6 +381,10 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -cache=SECTORS     Size the buffer cache to SECTORS sectors.\n"
+          "  -cache-policy=NAME Replace cache blocks by NAME: clock or 2q.\n"
+          "  -cache-flush=TICKS Write dirty cache blocks back every TICKS.\n"
+          "  -cache-dirty=N     Write back early once N sectors are dirty.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
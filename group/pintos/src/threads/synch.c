@@ -401,6 +401,104 @@ cond_broadcast (struct condition *cond, struct lock *lock)
     cond_signal (cond, lock);
 }
 
+/* Initializes RW as a reader-writer lock.  Any number of threads
+   may hold it to read at once, or one thread may hold it to
+   write.  A waiting writer keeps new readers out, so that a
+   steady stream of readers cannot starve it. */
+void
+rw_lock_init (struct rw_lock *rw)
+{
+  ASSERT (rw != NULL);
+
+  lock_init (&rw->lock);
+  cond_init (&rw->can_read);
+  cond_init (&rw->can_write);
+  rw->readers = 0;
+  rw->waiting_writers = 0;
+  rw->writer = NULL;
+}
+
+/* Acquires RW to read, sleeping while a writer holds it or waits
+   for it.  The current thread must not already hold RW.
+
+   This function may sleep, so it must not be called within an
+   interrupt handler. */
+void
+rw_lock_acquire_read (struct rw_lock *rw)
+{
+  ASSERT (rw != NULL);
+  ASSERT (!intr_context ());
+  ASSERT (rw->writer != thread_current ());
+
+  lock_acquire (&rw->lock);
+  while (rw->writer != NULL || rw->waiting_writers > 0)
+    cond_wait (&rw->can_read, &rw->lock);
+  rw->readers++;
+  lock_release (&rw->lock);
+}
+
+/* Releases RW, which the current thread holds to read. */
+void
+rw_lock_release_read (struct rw_lock *rw)
+{
+  ASSERT (rw != NULL);
+
+  lock_acquire (&rw->lock);
+  ASSERT (rw->readers > 0);
+  if (--rw->readers == 0)
+    cond_signal (&rw->can_write, &rw->lock);
+  lock_release (&rw->lock);
+}
+
+/* Acquires RW to write, sleeping until no other thread holds it.
+   The current thread must not already hold RW.
+
+   This function may sleep, so it must not be called within an
+   interrupt handler. */
+void
+rw_lock_acquire_write (struct rw_lock *rw)
+{
+  ASSERT (rw != NULL);
+  ASSERT (!intr_context ());
+  ASSERT (rw->writer != thread_current ());
+
+  lock_acquire (&rw->lock);
+  rw->waiting_writers++;
+  while (rw->writer != NULL || rw->readers > 0)
+    cond_wait (&rw->can_write, &rw->lock);
+  rw->waiting_writers--;
+  rw->writer = thread_current ();
+  lock_release (&rw->lock);
+}
+
+/* Releases RW, which the current thread holds to write.  Hands it
+   to the next waiting writer, if any, and otherwise lets in all
+   the waiting readers. */
+void
+rw_lock_release_write (struct rw_lock *rw)
+{
+  ASSERT (rw != NULL);
+  ASSERT (rw_lock_held_for_write (rw));
+
+  lock_acquire (&rw->lock);
+  rw->writer = NULL;
+  if (rw->waiting_writers > 0)
+    cond_signal (&rw->can_write, &rw->lock);
+  else
+    cond_broadcast (&rw->can_read, &rw->lock);
+  lock_release (&rw->lock);
+}
+
+/* Returns true if the current thread holds RW to write, false
+   otherwise. */
+bool
+rw_lock_held_for_write (const struct rw_lock *rw)
+{
+  ASSERT (rw != NULL);
+
+  return rw->writer == thread_current ();
+}
+
 void
 acquire_donations (struct lock* lock)
 {
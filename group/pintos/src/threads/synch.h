@@ -47,6 +47,24 @@ void cond_wait (struct condition *, struct lock *);
 void cond_signal (struct condition *, struct lock *);
 void cond_broadcast (struct condition *, struct lock *);
 
+/* Reader-writer lock. */
+struct rw_lock
+  {
+    struct lock lock;           /* Protects the members below. */
+    struct condition can_read;  /* Signaled when readers may enter. */
+    struct condition can_write; /* Signaled when a writer may enter. */
+    unsigned readers;           /* Number of threads holding it to read. */
+    unsigned waiting_writers;   /* Number of writers waiting. */
+    struct thread *writer;      /* Thread holding it to write, or NULL. */
+  };
+
+void rw_lock_init (struct rw_lock *);
+void rw_lock_acquire_read (struct rw_lock *);
+void rw_lock_release_read (struct rw_lock *);
+void rw_lock_acquire_write (struct rw_lock *);
+void rw_lock_release_write (struct rw_lock *);
+bool rw_lock_held_for_write (const struct rw_lock *);
+
 /* Helper functions */
 void acquire_donations (struct lock* lock);
 int release_donations (struct lock* lock);
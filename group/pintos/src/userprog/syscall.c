@@ -38,11 +38,13 @@ static int get_global_fd (struct FD_PTR* file);
 static int get_user_fd (struct FD_PTR* file);
 static int inumber (int fd);
 static void seek (int fd, unsigned int position);
+static bool truncate (int fd, unsigned int length);
 static void close (int fd);
 static void close_fd (struct FD_PTR * file);
 static unsigned int tell (int fd);
 static struct FD_PTR* get_user_fdptr (int fd);
 static void reset_buffer (void);
+static void get_block_stats (struct block_stats *user_stats);
 struct FD_PTR
   {
     uint8_t is_dir;
@@ -316,6 +318,14 @@ seek (int fd, unsigned int position)
     file_seek (File->fd_object, position);
 }
 
+bool
+truncate (int fd, unsigned int length)
+{
+  struct FD_PTR* File = get_user_fdptr (fd);
+  return (File != NULL && !File->is_dir
+          && file_truncate (File->fd_object, length));
+}
+
 unsigned int
 tell (int fd)
 {
@@ -434,6 +444,22 @@ reset_buffer (void) {
   reset_buffer_cache ();
 }
 
+/* Copies the block layer statistics out to USER_STATS, which has
+   been checked. */
+static void
+get_block_stats (struct block_stats *user_stats)
+{
+  struct block_stats *stats = malloc (sizeof *stats);
+  if (stats == NULL)
+    {
+      thread_current ()->exit_code = -1;
+      thread_exit ();
+    }
+  block_get_stats (stats);
+  memcpy (user_stats, stats, sizeof *stats);
+  free (stats);
+}
+
 static void
 syscall_handler (struct intr_frame *f UNUSED)
 {
@@ -636,9 +662,27 @@ syscall_handler (struct intr_frame *f UNUSED)
       arg0 = args[1];
 
       if ((uint32_t) arg0 == 0)
-        f->eax = (uint32_t) hits;
+        f->eax = (uint32_t) cache_hits ();
+      else if ((uint32_t) arg0 == 2)
+        f->eax = (uint32_t) block_read_cnt (fs_device);
+      else if ((uint32_t) arg0 == 3)
+        f->eax = (uint32_t) block_write_cnt (fs_device);
       else
-        f->eax = (uint32_t) misses;
+        f->eax = (uint32_t) cache_misses ();
+      break;
+    case SYS_GET_BLOCK_STATS:        /* Copy out cache and disk stats. */
+      check_user_n (args + 1, 4);
+      arg0 = args[1];
+      check_user_n ((void*) arg0, sizeof (struct block_stats));
+
+      get_block_stats ((struct block_stats *) arg0);
+      break;
+    case SYS_TRUNCATE:               /* Changes the length of a file. */
+      check_user_n (args + 1, 8);
+      arg0 = args[1];
+      arg1 = args[2];
+
+      f->eax = (uint32_t) truncate ((int) arg0, (unsigned int) arg1);
       break;
     default:                         /* All unimplemented syscalls. */
       thread_current ()->exit_code = -1;